@@ -0,0 +1,79 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef CLOUD_POOL //usd for conditional compiling.
+#define CLOUD_POOL
+
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <pcl/point_cloud.h>
+
+// Recycles point clouds between scans. A cloud from the pool is an ordinary shared pointer, when
+// the last owner lets go of it the cloud is cleared and handed back with its capacity, so once the
+// pool is warm the per-scan clouds do not touch the allocator. Clouds that outlive the pool are
+// deleted as usual. Thread safe.
+template <typename PointT>
+class CloudPool
+{
+    public:
+        typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+        CloudPool(std::size_t maxFree = 32) : storage(new Storage) { storage->maxFree = maxFree; }
+
+        CloudPtr acquire()
+        {
+            pcl::PointCloud<PointT> *cloud = NULL;
+            {
+                std::lock_guard<std::mutex> lock(storage->mtx);
+                if (!storage->free.empty()){
+                    cloud = storage->free.back();
+                    storage->free.pop_back();
+                }
+            }
+            if (cloud == NULL)
+                cloud = new pcl::PointCloud<PointT>;
+            return CloudPtr(cloud, Recycler(storage));
+        }
+
+    private:
+        struct Storage
+        {
+            std::mutex mtx;
+            std::vector<pcl::PointCloud<PointT>*> free;
+            std::size_t maxFree = 32;
+            ~Storage()
+            {
+                for (auto cloud : free){
+                    delete cloud;
+                }
+            }
+        };
+
+        struct Recycler
+        {
+            boost::weak_ptr<Storage> storage;
+            Recycler(const boost::shared_ptr<Storage> &storage) : storage(storage) {}
+
+            void operator()(pcl::PointCloud<PointT> *cloud) const
+            {
+                boost::shared_ptr<Storage> pool = storage.lock();
+                if (pool){
+                    cloud->clear(); // Keeps the capacity
+                    cloud->header = pcl::PCLHeader();
+                    std::lock_guard<std::mutex> lock(pool->mtx);
+                    if (pool->free.size() < pool->maxFree){
+                        pool->free.push_back(cloud);
+                        return;
+                    }
+                }
+                delete cloud;
+            }
+        };
+
+        boost::shared_ptr<Storage> storage;
+};
+#endif
@@ -4,61 +4,247 @@
 #ifndef FEATURE_ASSOCIATION //usd for conditional compiling.
 #define FEATURE_ASSOCIATION
 
-#include <ros/ros.h> // including the ros header file
-#include <sensor_msgs/PointCloud2.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
 
-#include <pcl_ros/point_cloud.h>
+#include <Eigen/Geometry>
+#include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/range_image/range_image.h>
-#include <tf/transform_broadcaster.h>
+#include <pcl/search/kdtree.h>
+#include <pcl/correspondence.h>
 
-class FeatureAssociation
+#include "ring_buffer.hpp"
+#include "point_array_view.hpp"
+#include "voxel_hash_filter.hpp"
+#include "leaf_size_controller.hpp"
+#include "ground_plane_tracker.hpp"
+#include "cloud_pool.hpp"
+#include "stage_profiler.hpp"
+
+// Kd-tree that is only rebuilt when it is given a different cloud. PCL keypoint detectors reset
+// the input of their search method, which would otherwise rebuild a tree that is already there.
+template <typename PointT>
+class SharedKdTree : public pcl::search::KdTree<PointT>
 {
     public:
-        FeatureAssociation(ros::NodeHandle &nh, ros::NodeHandle &pnh);
+        typedef boost::shared_ptr<SharedKdTree<PointT> > Ptr;
+        typedef typename pcl::search::KdTree<PointT>::PointCloudConstPtr PointCloudConstPtr;
+
+        SharedKdTree() : pcl::search::KdTree<PointT>(false) {}
+
+        void setInputCloud(const PointCloudConstPtr &cloud, const pcl::IndicesConstPtr &indices = pcl::IndicesConstPtr())
+        {
+            if (cloud == this->input_ && indices == this->indices_)
+                return;
+            pcl::search::KdTree<PointT>::setInputCloud(cloud, indices);
+        }
+};
+
+// Non-ground points of a scan with normals, and the single search structure built over them
+struct FeatureContext
+{
+    pcl::PointCloud<pcl::PointNormal>::Ptr surface;
+    SharedKdTree<pcl::PointNormal>::Ptr tree;
+    float leafSize = 0.2; // Leaf the scan was downsampled with, the search radii follow it
+    float normalRadius = 0.5;
+};
+
+// Nearest neighbour index over the descriptors of one scan, exact kd-tree or randomized kd-forest
+typedef pcl::search::Search<pcl::FPFHSignature33>::Ptr DescriptorIndexPtr;
+
+// Incoming scan waiting to be described
+struct ScanJob
+{
+    double stamp = 0;
+    PointArrayView scan;
+};
+
+// Scratch clouds and filters of one describing worker, reused from scan to scan
+struct ScanBuffers
+{
+    VoxelHashFilter<pcl::PointXYZ> pointFilter;
+    VoxelHashFilter<pcl::PointNormal> normalFilter;
+    pcl::PointCloud<pcl::PointXYZ> finiteCloud, downsampledCloud;
+    pcl::PointCloud<pcl::PointNormal> scanWithNormals, cloudWithNormals;
+    pcl::RangeImage rangeImage;
+    pcl::PointCloud<pcl::PointNormal> imageWithNormals; // One slot per pixel
+    std::vector<char> validNormal;
+};
+
+// Output of the stages that only depend on the scan itself
+struct ScanFeatures
+{
+    uint64_t seq = 0;
+    double stamp = 0;
+    bool valid = false;
+    float leafSize = 0;
+    std::size_t nPoints = 0; // After downsampling
+    pcl::PointCloud<pcl::PointNormal>::Ptr featureCloud, groundPlane;
+    // Keypoints and descriptors for descriptor matching, computed only on demand in the curvature mode
+    pcl::PointCloud<pcl::PointNormal>::Ptr keypoints;
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr descriptors;
+    DescriptorIndexPtr descriptorIndex;
+    FeatureContext context;
+};
+
+// Tuning of the front-end, every member has a usable default
+struct FeatureAssociationParameters
+{
+    float leafSize = 0.2; // Initial leaf size, adapted per scan when a target is set
+    float normalRadiusFactor = 2.5; // Normal radius in leaf sizes, the other radii are multiples of it
+    int minNrOfFeatures=30;
+
+    // Adaptive leaf size, "fixed", "points" or "time"
+    std::string leafSizeMode = "fixed";
+    int targetPoints = 4000; // Points after downsampling
+    double timeBudget = 0.08; // s, to describe one scan
+    float minLeafSize = 0.1, maxLeafSize = 0.6;
+    int maxPointsPerScan = 8000; // Hard cap, a scan above it is downsampled again at once, 0 disables
+
+    // Normals from the sensor ring/column grid instead of a radius search
+    bool rangeImageNormalsFlag = true;
+    int rangeImageHalfWindowCols = 3, rangeImageHalfWindowRows = 1;
+    int minNeighboursNormal = 4;
+
+    // Features: "iss_fpfh" keypoints with descriptors, or "curvature" edge and planar points along the scan rings
+    std::string featureModeName = "iss_fpfh";
+    int curvatureHalfWindow = 5; // Points on each side along the ring
+    int curvatureSectors = 6; // Per ring
+    int maxEdgesPerSector = 2, maxPlanarPerSector = 4;
+    float edgeThreshold = 0.1, planarThreshold = 0.01; // Squared curvature, relative to the range
+    float curvatureMaxRangeJump = 0.1; // Relative, larger jumps are occlusion borders and not used
+
+    // Ground plane, tracked from scan to scan with RANSAC as fallback
+    bool groundTrackingFlag = true;
+    float groundDistanceThreshold = 0.1; // m
+
+    // Pipeline parameters
+    int nrOfWorkers = 3; // Scans being described concurrently
+    int threadsPerStage = 2; // Threads inside the per-point stages
+    int scanBufferSize = 8;
+    std::string scanDropPolicy = "oldest"; // "oldest" or "newest"
+
+    // Motion-predicted fast path, descriptor matching only runs when it fails the quality check
+    bool fastPathFlag = true;
+    int fastPathIterations = 5;
+    int fastPathMaxPoints = 1500;
+    float fastPathMaxCorrespondenceDistance = 0.5; // m
+    double fastPathPriorWeight = 0.01; // Pull towards the prediction, per correspondence
+    float fastPathMinInlierRatio = 0.6;
+    float fastPathMaxRms = 0.08; // m
+    float fastPathMaxCorrectionTranslation = 0.5; // m, from the prediction
+    float fastPathMaxCorrectionAngle = 0.05; // rad, from the prediction
+
+    // Descriptor matching, the approximate mode bounds the cost when the number of features spikes
+    bool approximateDescriptorSearchFlag = false;
+    int descriptorForestTrees = 4;
+    int descriptorSearchChecks = 64;
+};
+
+// Result of matching one scan against the previous one
+struct ScanOdometry
+{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    double stamp = 0;
+    Eigen::Affine3d transformation; // Motion since the previous scan
+    bool predicted = false; // Registration failed and the motion model was used
+    pcl::PointCloud<pcl::PointNormal>::ConstPtr featureCloud, groundPlane;
+};
+
+// Scan to scan odometry. Plain C++, scans go in through addScan and every matched scan is handed
+// to the callback on the matching thread, so it runs without a ROS master. The node wraps it in
+// FeatureAssociationRos.
+class FeatureAssociation : private FeatureAssociationParameters
+{
+    public:
+        typedef std::function<void(const ScanOdometry&)> OdometryCallback;
+
+        FeatureAssociation(const FeatureAssociationParameters &parameters = FeatureAssociationParameters(), const OdometryCallback &callback = OdometryCallback());
         ~FeatureAssociation(); // destructor method
-        void runOnce();
+
+        // Queues a scan, returns false if a scan was dropped. With wait it blocks until there is room instead.
+        bool addScan(const PointArrayView &scan, double stamp, bool wait = false);
+        // Blocks until every queued scan has been matched
+        void flush();
+
+        uint64_t getReceivedScans() const { std::lock_guard<std::mutex> lock(pipelineMtx); return scanBuffer.getPushed(); }
+        uint64_t getDroppedScans() const { std::lock_guard<std::mutex> lock(pipelineMtx); return scanBuffer.getDropped(); }
+        uint64_t getFastPathHits() const { return fastPathHits; }
+        uint64_t getFastPathMisses() const { return fastPathMisses; }
+        uint64_t getRegistrationFailures() const { return registrationFailures; }
+#ifdef TUNNEL_SLAM_PROFILING
+        StageProfiler &getProfiler() { return profiler; }
+#endif
+
     private:
-        // Callbacks
-        void pointCloud2Handler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
-
-        float leafSize = 0.2;
-        float normalRadius = leafSize*2.5;
-        int minNrOfFeatures=30;
-
-        // ROS Members
-        ros::NodeHandle nh_; // Defining the ros NodeHandle variable for registrating the same with the master
-        ros::Subscriber subPointCloud2;
-        ros::Publisher pubFeatureCloud2;
-        ros::Publisher pubGroundPlaneCloud2;
-        ros::Publisher pubOdometry;
-        tf::TransformBroadcaster odomBroadcaster;
-
-        // Previous point clouds
-        pcl::PointCloud<pcl::PointNormal> _prevFeatureCloud = pcl::PointCloud<pcl::PointNormal>();
-        pcl::PointCloud<pcl::FPFHSignature33> _prevFeatureDescriptor = pcl::PointCloud<pcl::FPFHSignature33>();
-        pcl::PointCloud<pcl::PointNormal> _prevGroundPlaneCloud = pcl::PointCloud<pcl::PointNormal>();
+        LeafSizeController leafSizeController;
+        GroundPlaneTracker groundPlaneTracker;
+        enum FeatureMode { ISS_FPFH, CURVATURE };
+        FeatureMode featureMode = ISS_FPFH;
+
+        OdometryCallback odometryCallback;
+
+#ifdef TUNNEL_SLAM_PROFILING
+        StageProfiler profiler;
+#endif
+
+        // Per-scan clouds are taken from the pools and handed back when the last owner drops them
+        CloudPool<pcl::PointNormal> pointPool;
+        CloudPool<pcl::FPFHSignature33> descriptorPool;
+
+        // Previous point clouds, shared with the scan that produced them
+        pcl::PointCloud<pcl::PointNormal>::ConstPtr _prevFeatureCloud, _prevKeypoints;
+        pcl::PointCloud<pcl::FPFHSignature33>::ConstPtr _prevFeatureDescriptor;
+        pcl::PointCloud<pcl::PointNormal>::ConstPtr _prevGroundPlaneCloud;
+        FeatureContext _prevContext;
+        DescriptorIndexPtr _prevDescriptorIndex;
 
         //Transformation
         Eigen::Affine3d transformation;
-        ros::Time currentTime, prevTime;
+        double prevTime = 0, scanTime = 0;
+        bool motionModelValid = false;
+        double lastDt = 0;
+        std::atomic<uint64_t> fastPathHits{0}, fastPathMisses{0}, registrationFailures{0};
 
-        bool newCloud = false;
-        pcl::PointCloud<pcl::PointXYZ> currentCloud;
+        // Pipeline members
+        bool running = true;
+        uint64_t nextScanSeq = 0, nextMatchSeq = 0, matchedScans = 0;
+        mutable std::mutex pipelineMtx;
+        std::condition_variable scanAvailable, featuresAvailable, scanTaken, scanMatched;
+        RingBuffer<ScanJob> scanBuffer; // Incoming scans, filled by addScan
+        std::map<uint64_t, ScanFeatures> describedScans; // Reorder buffer in front of the matching stage
+        std::vector<std::thread> workers;
+        std::thread matchingThread;
 
-        pcl::RangeImage _pointCloud2RangeImage(const pcl::PointCloud<pcl::PointNormal> &cloud);
+        void _describeLoop();
+        void _matchLoop();
+        void _describeScan(const PointArrayView &scan, ScanBuffers &buffers, ScanFeatures &features);
+        void _matchScan(ScanFeatures &features);
+
+        void _pointCloud2RangeImage(const pcl::PointCloud<pcl::PointXYZ> &cloud, pcl::RangeImage &rangeImage);
 
         // Feature extraction
-        void _calculateNormals(const pcl::PointCloud<pcl::PointXYZ> &cloud, pcl::PointCloud<pcl::PointNormal> &cloudWithNormals);
-        void _findGroundPlane(const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &groundPlane, pcl::PointCloud<pcl::PointNormal> &excludedGroundPlane);
-        void _extractFeatures(const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &output, pcl::PointCloud<pcl::FPFHSignature33> &descriptors);
-        void _publish(const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud);
+        void _calculateNormals(const FeatureContext &context);
+        void _calculateNormalsRangeImage(const pcl::PointCloud<pcl::PointXYZ> &cloud, float normalRadius, ScanBuffers &buffers, pcl::PointCloud<pcl::PointNormal> &cloudWithNormals);
+        bool _findGroundPlane(uint64_t seq, const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &groundPlane, pcl::PointCloud<pcl::PointNormal> &excludedGroundPlane, Eigen::Vector4f &plane);
+        void _extractFeatures(const FeatureContext &context, pcl::PointCloud<pcl::PointNormal> &output, pcl::PointCloud<pcl::FPFHSignature33> &descriptors);
+        bool _ensureDescriptors(ScanFeatures &features);
+        bool _describeKeypoints(const FeatureContext &context, pcl::PointCloud<pcl::PointNormal>::Ptr &keypoints, pcl::PointCloud<pcl::FPFHSignature33>::Ptr &descriptors, DescriptorIndexPtr &descriptorIndex);
+        void _extractCurvatureFeatures(const ScanBuffers &buffers, bool groundFound, const Eigen::Vector4f &groundCoefficients, pcl::PointCloud<pcl::PointNormal> &output);
 
         //Transformation calculations
         void _warpPoints(); // #TODO
-        void _calculateTransformation(const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud, const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::FPFHSignature33> &featureDescriptors);
-
-        void _publishTransformation();
-        void _publishFeatureCloud(const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud);
+        Eigen::Affine3d _predictTransformation(double dt) const;
+        bool _fastRegistration(const pcl::PointCloud<pcl::PointNormal> &source, Eigen::Matrix4f &T);
+        DescriptorIndexPtr _buildDescriptorIndex(const pcl::PointCloud<pcl::FPFHSignature33>::Ptr &descriptors) const;
+        void _matchDescriptors(const pcl::PointCloud<pcl::FPFHSignature33> &source, const DescriptorIndexPtr &sourceIndex, const pcl::PointCloud<pcl::FPFHSignature33> &target, const DescriptorIndexPtr &targetIndex, pcl::Correspondences &correspondences);
+        void _calculateTransformation(const pcl::PointCloud<pcl::PointNormal>::ConstPtr &groundPlaneCloud, const pcl::PointCloud<pcl::PointNormal>::ConstPtr &featureCloud, const pcl::PointCloud<pcl::FPFHSignature33>::ConstPtr &featureDescriptors, const DescriptorIndexPtr &descriptorIndex);
 };
 #endif
\ No newline at end of file
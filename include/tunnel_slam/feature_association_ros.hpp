@@ -0,0 +1,51 @@
+// Declaration file 
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef FEATURE_ASSOCIATION_ROS //usd for conditional compiling.
+#define FEATURE_ASSOCIATION_ROS
+
+#include <ros/ros.h> // including the ros header file
+#include <sensor_msgs/PointCloud2.h>
+#include <tf/transform_broadcaster.h>
+#ifdef TUNNEL_SLAM_PROFILING
+#include <diagnostic_msgs/DiagnosticArray.h>
+#endif
+
+#include "feature_association.hpp"
+
+// ROS side of the front-end: reads the parameters, feeds incoming scans to FeatureAssociation and
+// publishes its odometry and clouds
+class FeatureAssociationRos
+{
+    public:
+        FeatureAssociationRos(ros::NodeHandle &nh, ros::NodeHandle &pnh);
+        ~FeatureAssociationRos(); // destructor method
+    private:
+        // Callbacks
+        void pointCloud2Handler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
+
+        static FeatureAssociationParameters _readParameters(ros::NodeHandle &pnh);
+        void _publish(const ScanOdometry &odometry);
+        void _publishTransformation(const ScanOdometry &odometry);
+        void _publishFeatureCloud(const ScanOdometry &odometry);
+
+        // ROS Members
+        ros::NodeHandle nh_; // Defining the ros NodeHandle variable for registrating the same with the master
+        ros::Subscriber subPointCloud2;
+        ros::Publisher pubFeatureCloud2;
+        ros::Publisher pubGroundPlaneCloud2;
+        ros::Publisher pubOdometry;
+        tf::TransformBroadcaster odomBroadcaster;
+
+#ifdef TUNNEL_SLAM_PROFILING
+        // Stage latencies and counts, published as diagnostics every statisticsPeriod
+        double statisticsPeriod = 5; // s
+        ros::Publisher pubStatistics;
+        ros::WallTimer statisticsTimer;
+        void _publishStatistics(const ros::WallTimerEvent &event);
+#endif
+
+        // Last member, so its threads are joined before the publishers go away
+        FeatureAssociation featureAssociation;
+};
+#endif
@@ -5,21 +5,19 @@
 #define GRAPH
 
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <vector>
 #include <deque>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
 
-#include <ros/ros.h> // including the ros header file
-
-#include <pcl_ros/point_cloud.h>
+#include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
-#include <pcl/octree/octree_search.h>
 #include <pcl/kdtree/kdtree_flann.h>
-#include <pcl/filters/voxel_grid.h>
-
-#include <sensor_msgs/PointCloud2.h>
-#include <sensor_msgs/Imu.h>
-#include <nav_msgs/Odometry.h>
-#include <geometry_msgs/PoseStamped.h>
 
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/nonlinear/ISAM2.h>
@@ -31,6 +29,11 @@
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/navigation/ImuFactor.h>
 #include <gtsam/navigation/CombinedImuFactor.h>
+#include <gtsam_unstable/nonlinear/IncrementalFixedLagSmoother.h>
+
+#include "point_array_view.hpp"
+#include "voxel_hash_filter.hpp"
+#include "voxel_map_index.hpp"
 
 
 // POINT TYPE FOR REGISTERING ENTIRE POSE
@@ -47,46 +50,112 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(PointXYZRPY,
                                 (float, x, x) (float, y, y) (float, z, z) 
                                 (float, roll, roll) (float, pitch, pitch) (float, yaw, yaw));
 
-class Graph
+// Where the graph sends its map, clouds and poses. The ROS node publishes them, a replay can
+// leave it out and nothing is converted.
+class GraphOutput
+{
+    public:
+        enum Topic { MAP, REWORKED_MAP, CURRENT_CLOUD_IN_WORLD, POTENTIAL_LOOP_CLOUD, LATEST_KEY_FRAME_CLOUD, ICP_RESULT_CLOUD, POSE, POSE_ARRAY };
+
+        virtual ~GraphOutput() {}
+        // Lets the graph skip the work for outputs nobody listens to
+        virtual bool wants(Topic topic) const = 0;
+        virtual void publishCloud(Topic topic, const pcl::PointCloud<pointT> &cloud) = 0;
+        // Covariance in gtsam order, rotation first. Recovery never holds the pose back, so until the pose's own
+        // is known it is the newest one recovered for an earlier pose, NaN before the first.
+        virtual void publishPose(double stamp, const gtsam::Pose3 &pose, const gtsam::Matrix &covariance) = 0;
+        virtual void publishPoseArray(const std::vector<gtsam::Pose3> &poses) = 0;
+};
+
+// Fixed-lag smoother that lets the graph read its ISAM2, so estimates and covariances are read
+// the same way in both back-end modes
+class FixedLagIsam : public gtsam::IncrementalFixedLagSmoother
+{
+    public:
+        FixedLagIsam(double lag, const gtsam::ISAM2Params &parameters) : gtsam::IncrementalFixedLagSmoother(lag, parameters) {}
+        const gtsam::ISAM2 &isam2() const { return isam_; }
+};
+
+// Tuning of the back-end, every member has a usable default
+struct GraphParameters
+{
+    // Fixed-lag mode, a bounded window of keyframes instead of the full history, for long runs
+    bool fixedLagEnabledFlag = false;
+    double fixedLagKeyFrames = 200;
+
+    // Refinement with one aligned factor per pair of nearby keyframes instead of landmarks per map point
+    bool keyFrameFactorsEnabledFlag = false;
+    int keyFrameFactorNeighbours = 3; // Earlier keyframes within localMapRadius each new keyframe is aligned to
+    int keyFrameAlignmentIterations = 10;
+    double structureVariance = 0.2; // m², per point of a keyframe alignment
+    double keyFrameFitnessScore = 0.3; // m², mean squared distance above which an alignment is left out
+    double keyFrameMinInformation = 1e-2; // Floor of the alignment information, for directions a straight tunnel does not observe
+
+    // Extra ISAM2 updates after adding factors, per call site
+    int keyFrameIsamIterations = 1, refineIsamIterations = 1, loopClosureIsamIterations = 1;
+};
+
+// Sets one parameter from a "key=value" argument, false if the key is unknown or the value does not parse
+bool setGraphParameter(GraphParameters &parameters, const std::string &argument);
+
+// Back-end, plain C++ so it runs without a ROS master. Measurements go in through the add
+// methods, runOnce processes them, runRefine and runLoopClosure run on their own threads until
+// stop is called. The node wraps it in GraphRos.
+class Graph : private GraphParameters
 {
     public:
-        Graph(ros::NodeHandle &nh, ros::NodeHandle &pnh);
+        Graph(const GraphParameters &graphParameters = GraphParameters(), GraphOutput *output = NULL);
         ~Graph(); // destructor method
-        void odometryHandler(const nav_msgs::OdometryConstPtr &odomMsg);
-        void mapHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
-        void groundPlaneHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
-        void imuHandler(const sensor_msgs::ImuConstPtr &imuMsg);
-        void gnssHandler(const geometry_msgs::PoseStampedConstPtr &gnssMsg);
+        void addOdometry(double time, const gtsam::Pose3 &displacement);
+        void addFeatureCloud(double time, const PointArrayView &cloud); // Only the view is kept until the cloud is processed
+        void addGroundPlane(double time, const PointArrayView &cloud);
+        void addImu(double time, const gtsam::Vector6 &measurement); // Acceleration and angular velocity in the lidar frame
+        void addGnss(double time, const gtsam::Point3 &position);
 
         double getCurrentTimeOdometry(void) const { return timeOdometry; }
+        gtsam::Pose3 getCurrentPose();
+        void getKeyPoses(std::vector<std::pair<double, gtsam::Pose3> > &keyPoses); // [time, pose] of every keyframe
+        std::size_t getMapSize(); // Points in the full map
 
         void runOnce(int &runsWithoutUpdate);
         void runRefine();
         void runLoopClosure();
+        void stop(); // Ends runRefine and runLoopClosure
         void writeToFile();
     private:
         void _mapToGraph();
-        // ROS Members
-        ros::NodeHandle nh_; // Defining the ros NodeHandle variable for registrating the same with the master
-        ros::Subscriber subOdometry;
-        ros::Subscriber subMap, subGroundPlane;
-        ros::Subscriber subImu;
-        ros::Subscriber subGnss;
-        ros::Publisher pubTransformedMap;
-        ros::Publisher pubTransformedPose;
-        ros::Publisher pubPoseArray;
-        ros::Publisher pubReworkedMap;
-        ros::Publisher pubCurrentCloudInWorld;
-        ros::Publisher pubPotentialLoopCloud;
-        ros::Publisher pubLatestKeyFrameCloud;
-        ros::Publisher pubICPResultCloud;       
-        ros::Time timer;
+        void _keyFramesToGraph(); // Refinement with one aligned factor per pair of nearby keyframes, no landmarks
+        bool _alignKeyFrames(const pcl::PointCloud<pointT> &source, const pcl::PointCloud<pointT> &target, gtsam::Pose3 &relative, gtsam::Matrix &information);
+        GraphOutput *output;
+
+        // Threads
+        bool running = true;
+        std::mutex runningMtx;
+        std::condition_variable stopRequested;
+        bool _sleepFor(double seconds); // False once stopped
+        bool _wants(GraphOutput::Topic topic) const { return output != NULL && output->wants(topic); }
+
+        // Marginal covariances are recovered on their own thread, so publishing a pose never waits for them
+        std::deque<gtsam::Key> covarianceRequests;
+        std::mutex covarianceMtx;
+        std::condition_variable covarianceRequested;
+        bool covarianceStopped = false;
+        std::thread covarianceThread;
+        gtsam::Matrix latestCovariance = gtsam::Matrix::Constant(6, 6, std::numeric_limits<double>::quiet_NaN()); // Of the newest recovered pose, unknown until then
+        void _publishPose(double stamp, const gtsam::Pose3 &pose, gtsam::Key key); // With the cached or latest covariance, caller holds mtx
+        void _runCovariances();
 
         // Optimization parameters
         bool smoothingEnabledFlag=true, imuEnabledFlag=true, gnssEnabledFlag=true, loopClosureEnabledFlag=true;
         double voxelRes = 0.1;
         double keyFrameSaveDistance = 3;
         double minCorresponendencesStructure = 30;
+        float maxCorrespondenceDistance = 2.0; // m, scan to local map, also the cell size of its index
+        float refinedMapMinDistance = 1.0; // m, between landmarks of the refined map
+        double localMapRadius = 30; // m, keyframes further away are left out of the local map
+        int localMapMaxKeyFrames = 10; // The closest ones within the radius
+        float fullMapMinDistance = 0.5; // m, between points added to the full map
+        float refineMatchDistance = 2.0; // m, keyframe to full map in the refinement, also the cell size of its index
         int cloudsInQueue = 0;
 
         int historyKeyFrameSearchRadius = 20;
@@ -111,25 +180,52 @@ class Graph
         bool newLaserOdometry=false, newMap=false, newGroundPlane=false, newImu=false, updateImu=false, newGnss=false, reinitialize=false;
         // gtsam estimation members
         gtsam::NonlinearFactorGraph _graph;
-        gtsam::Values initialEstimate, isamCurrentEstimate;
-        gtsam::ISAM2 *isam;
+        gtsam::Values initialEstimate, isamCurrentEstimate; // Poses are always current, other variables through _currentEstimate
+        gtsam::ISAM2 *isam = NULL; // Full history
+        FixedLagIsam *fixedLagIsam = NULL; // Or the window of the fixed-lag mode
+        double fixedLagStamp = 0; // Latest keyframe index, the clock of the fixed-lag smoother
+        const gtsam::ISAM2 &_isam() const { return fixedLagIsam != NULL ? fixedLagIsam->isam2() : *isam; }
+        void _updateFixedLag(const gtsam::NonlinearFactorGraph &graph, const gtsam::Values &values, int extraIterations);
+        bool _frozen(gtsam::Key key) const { return fixedLagIsam != NULL && isamCurrentEstimate.exists(key) && !fixedLagIsam->isam2().valueExists(key); } // Marginalized out of the window
+        uint64_t isamVersion = 0; // Counts the ISAM2 updates
+        std::map<gtsam::Key, std::pair<uint64_t, gtsam::Matrix> > covarianceCache; // Key to [ISAM2 version, covariance]
+        const gtsam::Matrix &_marginalCovariance(gtsam::Key key); // Cached until the next update, caller holds mtx
+        void _jointCovariances(const gtsam::KeyVector &keys, std::vector<gtsam::Matrix> &covariances); // One elimination for all keys, caller holds mtx and refreshes the estimate
 
         gtsam::noiseModel::Diagonal::shared_ptr priorNoise, odometryNoise, constraintNoise, structureNoise, gnssNoise, loopClosureNoise;
 
         gtsam::noiseModel::Isotropic::shared_ptr imuVelocityNoise, imuBiasNoise;
 
 
-        pcl::VoxelGrid<pointT> downSizeFilterMap;
+        VoxelHashFilter<pointT> downSizeFilterMap;
         pcl::PointXYZ previousPosPoint, currentPosPoint;
-        pcl::PointCloud<pointT>::Ptr currentFeatureCloud, currentGroundPlaneCloud, latestKeyFrameCloud, nearHistoryKeyFrameCloud;
+        PointArrayView currentFeatureView, currentGroundPlaneView; // Latest clouds, not copied yet
+        pcl::PointCloud<pointT>::Ptr currentFeatureCloud, latestKeyFrameCloud, nearHistoryKeyFrameCloud;
         pcl::PointCloud<pcl::PointXYZ>::Ptr cloudKeyPositions; // Contains key positions
         pcl::PointCloud<PointXYZRPY>::Ptr cloudKeyPoses; // Contains key poses
+        std::vector<uint64_t> keyPoseVersions; // Bumped whenever ISAM2 changes the key pose
+        gtsam::KeySet changedPoseKeys, staleKeys; // Changed by the ISAM2 updates, poses until the caches are updated, the rest until the full estimate is read
         pcl::KdTreeFLANN<pointT>::Ptr kdtreeHistoryKeyPositions;
 
         std::vector<pcl::PointCloud<pointT>::Ptr> cloudKeyFrames;
         pcl::PointCloud<pointT>::Ptr localKeyFramesMap, cloudMapFull, cloudMapRefined; //For publishing only
+        struct LocalKeyFrame
+        {
+            int begin, end; // Points in localKeyFramesMap
+            gtsam::Pose3 pose; // It was inserted at
+            uint64_t version; // Of the key pose at insertion
+        };
+        std::map<int, LocalKeyFrame> localKeyFrames; // By keyframe index
+        // Scan to map reads the keyframes of the local window at their current poses. Refinement and both
+        // kinds of deduplication read the full map, which keeps the points where they were added.
+        VoxelMapIndex localMapIndex; // Over localKeyFramesMap, removed points leave gaps until it is compacted
+        VoxelMapIndex fullMapIndex; // Over cloudMapFull by point index, which only grows
+        std::vector<char> isLandmark; // By point of cloudMapFull
+        std::mutex mapMtx; // Guards cloudMapFull, fullMapIndex and isLandmark, refinement searches them without mtx
+        std::unordered_map<gtsam::Key, int> refinedIndex; // Landmark to its point in cloudMapRefined
+        gtsam::KeySet movedLandmarkKeys; // Read back since runRefine last wrote cloudMapRefined
+        pcl::PointCloud<pointT> newMapPoints;
         pcl::PointCloud<pcl::PointXYZ>::Ptr reworkedMap;
-        pcl::octree::OctreePointCloudSearch<pointT>::Ptr octreeMap;
         std::vector<std::pair<gtsam::Key, int>> mapKeys;
 
         gtsam::Pose3 currentPoseInWorld, lastPoseInWorld = gtsam::Pose3::identity();
@@ -145,15 +241,25 @@ class Graph
 
 
         
+        void _takeFeatureCloud();
         void _incrementPosition();
         void _transformMapToWorld();
-        void _transformToGlobalMap(); // Adds to the octree structure and fullmap simultaneously
+        void _transformToGlobalMap(); // Adds the points in new voxels to the full map
+        void _addToFullMap(const pcl::PointCloud<pointT> &cloudInWorld, float minDistance);
         void _performIsam();
+        void _updateIsam(const gtsam::NonlinearFactorGraph &graph, const gtsam::Values &values, int extraIterations); // Also updates the poses in isamCurrentEstimate and the key pose caches
+        void _recordChangedKeys(const gtsam::ISAM2Result &result);
+        void _readChangedPoses();
+        void _refreshEstimate(); // Marks every variable as changed, for estimates that leave the graph
+        const gtsam::Values &_currentEstimate(); // isamCurrentEstimate with the changed variables brought up to date
         void _publishTrajectory();
         void _publishTransformed();
         void _fromPointXYZRPYToPose3(const PointXYZRPY &poseIn, gtsam::Pose3 &poseOut);
         void _fromPose3ToPointXYZRPY(const gtsam::Pose3 &poseIn, PointXYZRPY &poseOut);
         void _cloud2Map();
+        void _updateLocalMap();
+        void _addToLocalMap(int keyFrame, const gtsam::Pose3 &pose);
+        void _removeFromLocalMap(int keyFrame);
         void _initializePreintegration();
         void _preProcessIMU();
         void _postProcessIMU();
@@ -0,0 +1,56 @@
+// Declaration file 
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef GRAPH_ROS //usd for conditional compiling.
+#define GRAPH_ROS
+
+#include <ros/ros.h> // including the ros header file
+
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/Imu.h>
+#include <nav_msgs/Odometry.h>
+#include <geometry_msgs/PoseStamped.h>
+
+#include "graph.hpp"
+
+// ROS side of the back-end: feeds the subscribed messages to the graph and publishes what it outputs
+class GraphRos : public GraphOutput
+{
+    public:
+        GraphRos(ros::NodeHandle &nh, ros::NodeHandle &pnh);
+        ~GraphRos(); // destructor method
+        void odometryHandler(const nav_msgs::OdometryConstPtr &odomMsg);
+        void mapHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
+        void groundPlaneHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg);
+        void imuHandler(const sensor_msgs::ImuConstPtr &imuMsg);
+        void gnssHandler(const geometry_msgs::PoseStampedConstPtr &gnssMsg);
+
+        Graph &graph() { return graph_; }
+
+        // GraphOutput
+        bool wants(Topic topic) const;
+        void publishCloud(Topic topic, const pcl::PointCloud<pointT> &cloud);
+        void publishPose(double stamp, const gtsam::Pose3 &pose, const gtsam::Matrix &covariance);
+        void publishPoseArray(const std::vector<gtsam::Pose3> &poses);
+    private:
+        // ROS Members
+        ros::NodeHandle nh_; // Defining the ros NodeHandle variable for registrating the same with the master
+        ros::Subscriber subOdometry;
+        ros::Subscriber subMap, subGroundPlane;
+        ros::Subscriber subImu;
+        ros::Subscriber subGnss;
+        ros::Publisher pubTransformedMap;
+        ros::Publisher pubTransformedPose;
+        ros::Publisher pubPoseArray;
+        ros::Publisher pubReworkedMap;
+        ros::Publisher pubCurrentCloudInWorld;
+        ros::Publisher pubPotentialLoopCloud;
+        ros::Publisher pubLatestKeyFrameCloud;
+        ros::Publisher pubICPResultCloud;
+
+        Graph graph_;
+
+        const ros::Publisher &_publisher(Topic topic) const;
+        static GraphParameters _readParameters(ros::NodeHandle &pnh);
+};
+#endif
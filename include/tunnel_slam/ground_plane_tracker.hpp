@@ -0,0 +1,181 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef GROUND_PLANE_TRACKER //usd for conditional compiling.
+#define GROUND_PLANE_TRACKER
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+
+// Follows the floor plane from scan to scan. The plane of the previous scan is refined with a few
+// iteratively reweighted least squares steps over the points close to it, which costs the same on
+// every scan. When too few points support the plane, or it jumps, tracking is lost and the caller
+// falls back to a full RANSAC fit and seeds the tracker again. Planes are (a, b, c, d) with a unit
+// normal pointing up, towards the sensor. Shared by the describing workers, which finish scans out
+// of order, so results are keyed by scan sequence number and applied in sequence: a scan always
+// starts from the plane of the scan right before it.
+class GroundPlaneTracker
+{
+    public:
+        GroundPlaneTracker() {}
+
+        void setParameters(float distanceThreshold, float gateDistance, int iterations, int minInliers, float minInlierRatio, float maxAngleChange, float maxHeightChange)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            inlierThreshold = distanceThreshold;
+            gate = gateDistance;
+            nIterations = iterations;
+            minNrOfInliers = minInliers;
+            minRatio = minInlierRatio;
+            maxAngle = maxAngleChange;
+            maxHeight = maxHeightChange;
+        }
+
+        // Plane of the scan before seq, waits until that scan is through. False while tracking is lost.
+        bool predict(uint64_t seq, Eigen::Vector4f &plane)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            applied.wait(lock, [this, seq]{ return stopped || nextSeq >= seq; });
+            if (stopped || !tracking)
+                return false;
+            plane = currentPlane;
+            return true;
+        }
+
+        // Refines the predicted plane over the candidate ground points, false if tracking is lost
+        template <typename PointT>
+        bool refine(const pcl::PointCloud<PointT> &candidates, Eigen::Vector4f &plane) const
+        {
+            float threshold, gateDistance, ratio, angle, height;
+            int iterations, minInliers;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                threshold = inlierThreshold; gateDistance = gate; iterations = nIterations;
+                minInliers = minNrOfInliers; ratio = minRatio; angle = maxAngle; height = maxHeight;
+            }
+            if (candidates.size() < (std::size_t) minInliers)
+                return false;
+
+            const Eigen::Vector4f predicted = plane;
+            for (int iter = 0; iter < iterations; iter++){
+                // Accumulated relative to a point on the current plane to keep the covariance well conditioned
+                Eigen::Vector3d origin = (-plane[3]*plane.head<3>()).cast<double>();
+                Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+                Eigen::Matrix3d sumSquared = Eigen::Matrix3d::Zero();
+                double sumWeights = 0;
+                int nSupport = 0;
+                for (const auto &point : candidates.points){
+                    float distance = plane.head<3>().dot(point.getVector3fMap()) + plane[3];
+                    if (std::fabs(distance) > gateDistance)
+                        continue;
+                    // Cauchy weights, points on a curb or the wall foot fade out instead of being cut
+                    double r = distance / threshold;
+                    double w = 1.0 / (1.0 + r*r);
+                    Eigen::Vector3d p = point.getVector3fMap().template cast<double>() - origin;
+                    sum += w*p;
+                    sumSquared += w*p*p.transpose();
+                    sumWeights += w;
+                    nSupport++;
+                }
+                if (nSupport < minInliers)
+                    return false;
+
+                Eigen::Vector3d mean = sum / sumWeights;
+                Eigen::Matrix3d covariance = sumSquared / sumWeights - mean*mean.transpose();
+                Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+                Eigen::Vector3d normal = solver.eigenvectors().col(0);
+                if (normal.z() < 0)
+                    normal = -normal;
+                plane.head<3>() = normal.cast<float>();
+                plane[3] = (float) -normal.dot(mean + origin);
+            }
+
+            // Support and continuity checks against the prediction
+            int nInliers = 0;
+            for (const auto &point : candidates.points){
+                if (std::fabs(plane.head<3>().dot(point.getVector3fMap()) + plane[3]) <= threshold)
+                    nInliers++;
+            }
+            if (nInliers < minInliers || nInliers < ratio*candidates.size())
+                return false;
+            float cosAngle = std::min(1.0f, std::fabs(plane.head<3>().dot(predicted.head<3>())));
+            if (std::acos(cosAngle) > angle || std::fabs(plane[3] - predicted[3]) > height)
+                return false;
+            return true;
+        }
+
+        void update(uint64_t seq, const Eigen::Vector4f &plane, bool tracked)
+        {
+            _record(seq, tracked ? TRACKED : REINITIALIZED, plane);
+        }
+
+        void lose(uint64_t seq)
+        {
+            _record(seq, LOST, Eigen::Vector4f::Zero());
+        }
+
+        // Every scan ends with this, a scan without a ground fit passes the plane before it on
+        void skip(uint64_t seq)
+        {
+            _record(seq, SKIPPED, Eigen::Vector4f::Zero());
+        }
+
+        // Releases the waiting workers
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopped = true;
+            applied.notify_all();
+        }
+
+        uint64_t getTracked() const { std::lock_guard<std::mutex> lock(mtx); return nTracked; }
+        uint64_t getReinitialized() const { std::lock_guard<std::mutex> lock(mtx); return nReinitialized; }
+
+    private:
+        enum Outcome { TRACKED, REINITIALIZED, LOST, SKIPPED };
+        typedef Eigen::Matrix<float, 4, 1, Eigen::DontAlign> Plane; // Unaligned, owners need no aligned new
+
+        mutable std::mutex mtx;
+        std::condition_variable applied;
+        bool stopped = false;
+        bool tracking = false;
+        Plane currentPlane = Eigen::Vector4f(0, 0, 1, 0); // After every scan before nextSeq
+        uint64_t nextSeq = 0;
+        std::map<uint64_t, std::pair<Outcome, Plane> > finished; // Scans done ahead of nextSeq
+        uint64_t nTracked = 0, nReinitialized = 0;
+
+        void _record(uint64_t seq, Outcome outcome, const Eigen::Vector4f &plane)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            // The first result of a scan counts, the skip at its end is then ignored
+            if (seq < nextSeq || !finished.insert(std::make_pair(seq, std::make_pair(outcome, Plane(plane)))).second)
+                return;
+            for (auto next = finished.find(nextSeq); next != finished.end(); next = finished.find(nextSeq)){
+                switch (next->second.first){
+                    case TRACKED: nTracked++; currentPlane = next->second.second; tracking = true; break;
+                    case REINITIALIZED: nReinitialized++; currentPlane = next->second.second; tracking = true; break;
+                    case LOST: tracking = false; break;
+                    case SKIPPED: break;
+                }
+                finished.erase(next);
+                nextSeq++;
+            }
+            applied.notify_all();
+        }
+
+        float inlierThreshold = 0.1; // m
+        float gate = 0.3; // m, points further from the predicted plane are not used
+        int nIterations = 3;
+        int minNrOfInliers = 50;
+        float minRatio = 0.2; // Of the candidate points
+        float maxAngle = 0.1; // rad
+        float maxHeight = 0.2; // m
+};
+#endif
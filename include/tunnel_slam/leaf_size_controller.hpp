@@ -0,0 +1,80 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef LEAF_SIZE_CONTROLLER //usd for conditional compiling.
+#define LEAF_SIZE_CONTROLLER
+
+#include <mutex>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <algorithm>
+
+// Steers the voxel leaf size of the front-end towards a target number of downsampled points or a
+// time budget per scan. The point count on tunnel walls grows roughly with 1/leaf^2, and so does
+// the cost of the later stages, so the leaf is scaled with the square root of the measured ratio.
+// Shared by the describing workers, every job reads the leaf it starts with and reports back.
+class LeafSizeController
+{
+    public:
+        enum Mode { FIXED, POINT_COUNT, TIME_BUDGET };
+
+        LeafSizeController(float leafSize = 0.2, float minLeafSize = 0.1, float maxLeafSize = 1.0)
+            : leaf(leafSize), minLeaf(minLeafSize), maxLeaf(maxLeafSize) {}
+
+        static Mode modeFromString(const std::string &mode)
+        {
+            if (mode == "points") return POINT_COUNT;
+            if (mode == "time") return TIME_BUDGET;
+            return FIXED;
+        }
+
+        // target is a number of points or seconds, gain in (0, 1] damps the step
+        void configure(Mode controlMode, double controlTarget, float leafSize, float minLeafSize, float maxLeafSize, double controlGain = 0.5)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            leaf = leafSize;
+            minLeaf = minLeafSize;
+            maxLeaf = maxLeafSize;
+            mode = controlMode;
+            target = controlTarget;
+            gain = controlGain;
+        }
+
+        float leafSize() const
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return leaf;
+        }
+
+        // Leaf that brings nPoints down to maxPoints, used to cap a single scan without waiting for the feedback
+        float capLeafSize(float usedLeafSize, std::size_t nPoints, std::size_t maxPoints) const
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (maxPoints == 0 || nPoints <= maxPoints)
+                return usedLeafSize;
+            return std::min(maxLeaf, usedLeafSize*(float) std::sqrt((double) nPoints / maxPoints));
+        }
+
+        // Feedback after a scan: the leaf it was described with, points after downsampling and time taken
+        void update(float usedLeafSize, std::size_t nPoints, double seconds)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (mode == FIXED || target <= 0)
+                return;
+            double measured = mode == POINT_COUNT ? (double) nPoints : seconds;
+            if (measured <= 0)
+                return;
+            // At most 25 % per scan, a single odd scan should not throw the density around
+            double step = std::pow(measured / target, 0.5*gain);
+            step = std::max(0.8, std::min(1.25, step));
+            leaf = std::max(minLeaf, std::min(maxLeaf, (float) (usedLeafSize*step)));
+        }
+
+    private:
+        mutable std::mutex mtx;
+        Mode mode = FIXED;
+        double target = 0, gain = 0.5;
+        float leaf, minLeaf, maxLeaf;
+};
+#endif
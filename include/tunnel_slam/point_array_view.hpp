@@ -0,0 +1,120 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef POINT_ARRAY_VIEW //usd for conditional compiling.
+#define POINT_ARRAY_VIEW
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <boost/shared_ptr.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// Read-only view of float x, y and z values in a strided array of points, laid out in rows like
+// an organized cloud. Points are read straight from the array, a copy is only made when a stage
+// asks for one. The view shares ownership of whatever holds the array, so the data stays alive
+// as long as the view does.
+class PointArrayView
+{
+    public:
+        PointArrayView() {}
+
+        // Raw array of height rows, each row width points of pointStep bytes and rowStep bytes long
+        PointArrayView(const uint8_t *data, std::size_t bytes, uint32_t width, uint32_t height, uint32_t pointStep, uint32_t rowStep,
+                       uint32_t offsetX, uint32_t offsetY, uint32_t offsetZ, bool isDense, const boost::shared_ptr<const void> &owner)
+            : owner_(owner), data_(data), width_(width), height_(height), pointStep_(pointStep), rowStep_(rowStep),
+              offsetX(offsetX), offsetY(offsetY), offsetZ(offsetZ), isDense_(isDense)
+        {
+            // Only if every point lies inside its row and the rows inside the array
+            const std::size_t fieldEnd = std::max(offsetX, std::max(offsetY, offsetZ)) + sizeof(float);
+            valid_ = data_ != NULL
+                     && fieldEnd <= pointStep_
+                     && (std::size_t) width_*pointStep_ <= rowStep_
+                     && bytes >= (std::size_t) rowStep_*height_;
+            if (valid_)
+                nPoints = (std::size_t) width_*height_;
+        }
+
+        // Any PCL point type with x, y and z, without copying the cloud
+        template <typename PointT>
+        explicit PointArrayView(const boost::shared_ptr<const pcl::PointCloud<PointT> > &cloud)
+        {
+            if (!cloud)
+                return;
+            const PointT point;
+            const uint8_t *base = reinterpret_cast<const uint8_t*>(&point);
+            // Clouds whose width and height do not match their size are read as one row
+            bool organized = (std::size_t) cloud->width*cloud->height == cloud->size();
+            uint32_t width = organized ? cloud->width : cloud->size();
+            *this = PointArrayView(reinterpret_cast<const uint8_t*>(cloud->points.data()), cloud->size()*sizeof(PointT),
+                                   width, organized ? cloud->height : 1, sizeof(PointT), width*sizeof(PointT),
+                                   reinterpret_cast<const uint8_t*>(&point.x) - base, reinterpret_cast<const uint8_t*>(&point.y) - base,
+                                   reinterpret_cast<const uint8_t*>(&point.z) - base, cloud->is_dense, cloud);
+        }
+
+        template <typename PointT>
+        explicit PointArrayView(const boost::shared_ptr<pcl::PointCloud<PointT> > &cloud)
+            : PointArrayView(boost::shared_ptr<const pcl::PointCloud<PointT> >(cloud)) {}
+
+        // False if the array does not have a layout the view can read
+        bool valid() const { return valid_; }
+        std::size_t size() const { return nPoints; }
+        bool empty() const { return nPoints == 0; }
+
+        inline void get(std::size_t i, float &x, float &y, float &z) const
+        {
+            const uint8_t *point = data_ + (i / width_)*rowStep_ + (i % width_)*pointStep_;
+            std::memcpy(&x, point + offsetX, sizeof(float));
+            std::memcpy(&y, point + offsetY, sizeof(float));
+            std::memcpy(&z, point + offsetZ, sizeof(float));
+        }
+
+        inline pcl::PointXYZ operator[](std::size_t i) const
+        {
+            pcl::PointXYZ point;
+            get(i, point.x, point.y, point.z);
+            return point;
+        }
+
+        // Copies the points into a cloud the caller owns, keeping the organization of the array
+        template <typename PointT>
+        void copyTo(pcl::PointCloud<PointT> &cloud) const
+        {
+            cloud.resize(nPoints);
+            for (std::size_t i = 0; i < nPoints; i++){
+                get(i, cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+            }
+            cloud.width = nPoints == 0 ? 0 : width_;
+            cloud.height = nPoints == 0 ? 0 : height_;
+            cloud.is_dense = isDense_;
+        }
+
+        // Copies only the finite points, this replaces a copy followed by removeNaNFromPointCloud
+        template <typename PointT>
+        void copyFiniteTo(pcl::PointCloud<PointT> &cloud) const
+        {
+            cloud.clear();
+            cloud.reserve(nPoints);
+            PointT point;
+            for (std::size_t i = 0; i < nPoints; i++){
+                get(i, point.x, point.y, point.z);
+                if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+                    continue;
+                cloud.push_back(point);
+            }
+            cloud.is_dense = true;
+        }
+
+    private:
+        boost::shared_ptr<const void> owner_;
+        const uint8_t *data_ = NULL;
+        uint32_t width_ = 0, height_ = 0, pointStep_ = 0, rowStep_ = 0;
+        uint32_t offsetX = 0, offsetY = 0, offsetZ = 0;
+        bool isDense_ = false;
+        bool valid_ = false;
+        std::size_t nPoints = 0;
+};
+#endif
@@ -0,0 +1,40 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef POINT_CLOUD2_VIEW //usd for conditional compiling.
+#define POINT_CLOUD2_VIEW
+
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/PointField.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include "point_array_view.hpp"
+
+// ROS side of PointArrayView. The float32 x, y and z fields of a PointCloud2 message are read
+// straight from its buffer, which the view keeps alive. Messages with another layout are
+// deserialized once with pcl::fromROSMsg and the view owns that copy instead.
+inline PointArrayView pointCloud2View(const sensor_msgs::PointCloud2ConstPtr &msg)
+{
+    if (!msg)
+        return PointArrayView();
+    int found = 0;
+    uint32_t offsetX = 0, offsetY = 0, offsetZ = 0;
+    for (const auto &field : msg->fields){
+        if (field.datatype != sensor_msgs::PointField::FLOAT32 || field.count != 1)
+            continue;
+        if (field.name == "x") { offsetX = field.offset; found |= 1; }
+        else if (field.name == "y") { offsetY = field.offset; found |= 2; }
+        else if (field.name == "z") { offsetZ = field.offset; found |= 4; }
+    }
+    // Only native byte order is read directly
+    if (found == 7 && !msg->is_bigendian){
+        PointArrayView view(msg->data.data(), msg->data.size(), msg->width, msg->height, msg->point_step, msg->row_step,
+                            offsetX, offsetY, offsetZ, msg->is_dense, msg);
+        if (view.valid())
+            return view;
+    }
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>());
+    pcl::fromROSMsg(*msg, *cloud);
+    return PointArrayView(cloud);
+}
+#endif
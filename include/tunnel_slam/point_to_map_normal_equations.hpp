@@ -0,0 +1,145 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef POINT_TO_MAP_NORMAL_EQUATIONS //usd for conditional compiling.
+#define POINT_TO_MAP_NORMAL_EQUATIONS
+
+#include <vector>
+#include <cstddef>
+
+#include <Eigen/Dense>
+
+// Gauss-Newton system of scan-to-map alignment over point-to-point correspondences. The residual
+// of a scan point p matched to the map point q is e = R*p + t - q, linearized in a right
+// perturbation [rotation, translation] of the pose, which gives J = [-R*[p]x, R]. Every residual is
+// whitened by the pose uncertainty seen through its Jacobian, W = J*S*J^T, so the system is
+// H = sum J^T*W^-1*J and g = -sum J^T*W^-1*e. Built per correspondence in fixed-size types with
+// a closed-form 3x3 inverse instead of stacking the whitened rows, split over threads with OpenMP.
+class PointToMapNormalEquations
+{
+    public:
+        typedef Eigen::Matrix<double, 6, 6> Matrix6;
+        typedef Eigen::Matrix<double, 6, 1> Vector6;
+
+        void clear()
+        {
+            localPoints.clear();
+            mapPoints.clear();
+        }
+
+        void reserve(std::size_t n)
+        {
+            localPoints.reserve(n);
+            mapPoints.reserve(n);
+        }
+
+        // Scan point in the scan frame and its match in the map
+        void add(const Eigen::Vector3d &local, const Eigen::Vector3d &map)
+        {
+            localPoints.push_back(local);
+            mapPoints.push_back(map);
+        }
+
+        std::size_t size() const { return localPoints.size(); }
+
+        // Linearizes all correspondences at the pose (R, t), the covariance is in gtsam order, rotation first
+        void linearize(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, const Matrix6 &poseCovariance, Matrix6 &H, Vector6 &g) const
+        {
+            H.setZero();
+            g.setZero();
+            const int n = (int) localPoints.size();
+            #pragma omp parallel if (n > minParallelSize)
+            {
+                Matrix6 threadH = Matrix6::Zero();
+                Vector6 threadG = Vector6::Zero();
+                Eigen::Matrix<double, 3, 6> J, JS;
+                J.rightCols<3>() = R;
+                #pragma omp for schedule(static) nowait
+                for (int i = 0; i < n; i++){
+                    const Eigen::Vector3d &p = localPoints[i];
+                    _rotationJacobian(R, p, J);
+                    JS.noalias() = J*poseCovariance;
+                    Eigen::Matrix3d W;
+                    W.noalias() = JS*J.transpose();
+                    const Eigen::Matrix3d information = _inverseSymmetric(W);
+                    const Eigen::Vector3d e = R*p + t - mapPoints[i];
+                    const Eigen::Matrix<double, 6, 3> JtInformation = J.transpose()*information;
+                    threadH.noalias() += JtInformation*J;
+                    threadG.noalias() -= JtInformation*e;
+                }
+                #pragma omp critical (point_to_map_normal_equations)
+                {
+                    H += threadH;
+                    g += threadG;
+                }
+            }
+        }
+
+        // Same with isotropic residuals of the given variance, for aligning clouds whose poses are both estimated
+        void linearize(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, double pointVariance, Matrix6 &H, Vector6 &g) const
+        {
+            H.setZero();
+            g.setZero();
+            const int n = (int) localPoints.size();
+            #pragma omp parallel if (n > minParallelSize)
+            {
+                Matrix6 threadH = Matrix6::Zero();
+                Vector6 threadG = Vector6::Zero();
+                Eigen::Matrix<double, 3, 6> J;
+                J.rightCols<3>() = R;
+                #pragma omp for schedule(static) nowait
+                for (int i = 0; i < n; i++){
+                    const Eigen::Vector3d &p = localPoints[i];
+                    _rotationJacobian(R, p, J);
+                    const Eigen::Vector3d e = R*p + t - mapPoints[i];
+                    threadH.noalias() += J.transpose()*J;
+                    threadG.noalias() -= J.transpose()*e;
+                }
+                #pragma omp critical (point_to_map_normal_equations)
+                {
+                    H += threadH;
+                    g += threadG;
+                }
+            }
+            H /= pointVariance;
+            g /= pointVariance;
+        }
+
+        // Sum of squared distances at the pose (R, t), without whitening
+        double cost(const Eigen::Matrix3d &R, const Eigen::Vector3d &t) const
+        {
+            const int n = (int) localPoints.size();
+            double sum = 0;
+            #pragma omp parallel for reduction(+:sum) schedule(static) if (n > minParallelSize)
+            for (int i = 0; i < n; i++){
+                sum += (R*localPoints[i] + t - mapPoints[i]).squaredNorm();
+            }
+            return sum;
+        }
+
+    private:
+        static const int minParallelSize = 512; // Below this the threads cost more than they save
+        std::vector<Eigen::Vector3d> localPoints, mapPoints;
+
+        // -R*[p]x into the rotation columns of J, column by column
+        static inline void _rotationJacobian(const Eigen::Matrix3d &R, const Eigen::Vector3d &p, Eigen::Matrix<double, 3, 6> &J)
+        {
+            J.col(0) = R.col(2)*p.y() - R.col(1)*p.z();
+            J.col(1) = R.col(0)*p.z() - R.col(2)*p.x();
+            J.col(2) = R.col(1)*p.x() - R.col(0)*p.y();
+        }
+
+        // Adjugate over determinant, W is symmetric positive definite since R has full rank
+        static Eigen::Matrix3d _inverseSymmetric(const Eigen::Matrix3d &W)
+        {
+            const double a = W(0, 0), b = W(0, 1), c = W(0, 2), d = W(1, 1), e = W(1, 2), f = W(2, 2);
+            const double A = d*f - e*e, B = c*e - b*f, C = b*e - c*d;
+            const double inverseDeterminant = 1.0 / (a*A + b*B + c*C);
+            Eigen::Matrix3d inverse;
+            inverse << A, B, C,
+                       B, a*f - c*c, b*c - a*e,
+                       C, b*c - a*e, a*d - b*b;
+            return inverse*inverseDeterminant;
+        }
+};
+#endif
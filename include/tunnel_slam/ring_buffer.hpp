@@ -0,0 +1,63 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef RING_BUFFER //usd for conditional compiling.
+#define RING_BUFFER
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Bounded FIFO with a fixed capacity. When it is full, a push either overwrites the oldest
+// element or is rejected, and the drop is counted. Not synchronized, guard it with a mutex.
+template <typename T>
+class RingBuffer
+{
+    public:
+        enum DropPolicy { DROP_OLDEST, DROP_NEWEST };
+
+        RingBuffer(std::size_t capacity = 1, DropPolicy policy = DROP_OLDEST)
+            : buffer(capacity > 0 ? capacity : 1), policy(policy) {}
+
+        // Returns false if an element had to be dropped
+        bool push(const T &item)
+        {
+            pushed++;
+            if (count == buffer.size()){
+                dropped++;
+                if (policy == DROP_NEWEST)
+                    return false;
+                buffer[head] = item;
+                head = (head + 1) % buffer.size();
+                return false;
+            }
+            buffer[(head + count) % buffer.size()] = item;
+            count++;
+            return true;
+        }
+
+        bool pop(T &item)
+        {
+            if (count == 0)
+                return false;
+            item = buffer[head];
+            buffer[head] = T(); // Release what the element holds
+            head = (head + 1) % buffer.size();
+            count--;
+            return true;
+        }
+
+        bool empty() const { return count == 0; }
+        std::size_t size() const { return count; }
+        std::size_t capacity() const { return buffer.size(); }
+        DropPolicy getDropPolicy() const { return policy; }
+        uint64_t getPushed() const { return pushed; }
+        uint64_t getDropped() const { return dropped; }
+
+    private:
+        std::vector<T> buffer;
+        DropPolicy policy;
+        std::size_t head = 0, count = 0;
+        uint64_t pushed = 0, dropped = 0;
+};
+#endif
@@ -0,0 +1,176 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef STAGE_PROFILER //usd for conditional compiling.
+#define STAGE_PROFILER
+
+// Per-stage timing of the front-end. Everything below is only compiled with TUNNEL_SLAM_PROFILING
+// (cmake -DTUNNEL_SLAM_PROFILING=ON), otherwise the macros expand to nothing.
+#ifdef TUNNEL_SLAM_PROFILING
+
+#include <map>
+#include <mutex>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sstream>
+#include <algorithm>
+
+#include <utility>
+
+// Latency histogram with log spaced buckets, 20 per decade from 1 us to 10 s. Percentiles are read
+// as the upper edge of their bucket, which is within 12 % of the true value.
+class LatencyHistogram
+{
+    public:
+        LatencyHistogram() : counts(nBuckets, 0) {}
+
+        void add(double seconds)
+        {
+            int bucket = seconds <= minSeconds ? 0 : (int) (std::log10(seconds / minSeconds)*bucketsPerDecade);
+            counts[std::min(bucket, nBuckets - 1)]++;
+            total++;
+            sum += seconds;
+            maximum = std::max(maximum, seconds);
+        }
+
+        double percentile(double p) const
+        {
+            if (total == 0)
+                return 0;
+            uint64_t rank = (uint64_t) std::ceil(p*total), seen = 0;
+            for (int i = 0; i < nBuckets; i++){
+                seen += counts[i];
+                if (seen >= rank)
+                    return std::min(maximum, minSeconds*std::pow(10.0, (i + 1) / (double) bucketsPerDecade));
+            }
+            return maximum;
+        }
+
+        uint64_t size() const { return total; }
+        double mean() const { return total > 0 ? sum / total : 0; }
+        double max() const { return maximum; }
+
+        void clear()
+        {
+            std::fill(counts.begin(), counts.end(), 0);
+            total = 0;
+            sum = maximum = 0;
+        }
+
+    private:
+        static constexpr double minSeconds = 1e-6;
+        static const int bucketsPerDecade = 20;
+        static const int nBuckets = 7*bucketsPerDecade;
+        std::vector<uint64_t> counts;
+        uint64_t total = 0;
+        double sum = 0, maximum = 0;
+};
+
+// One stage, or the counts, of a report. The node publishes each as a diagnostic status.
+struct StageStatus
+{
+    std::string name, message;
+    std::vector<std::pair<std::string, std::string> > values; // [key, value]
+};
+
+// Collects stage latencies and point counts from all threads. Every report covers the window since
+// the previous one, so the percentiles follow retuning instead of averaging over the whole run.
+class StageProfiler
+{
+    public:
+        void record(const char *stage, double seconds)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stages[stage].add(seconds);
+        }
+
+        void count(const char *name, std::size_t n)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Counter &counter = counters[name];
+            counter.samples++;
+            counter.sum += n;
+            counter.maximum = std::max<uint64_t>(counter.maximum, n);
+        }
+
+        // One status per stage and one for the counts, then starts a new window
+        void report(const std::string &name, std::vector<StageStatus> &statuses)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto &stage : stages){
+                const LatencyHistogram &histogram = stage.second;
+                StageStatus status;
+                status.name = name + ": " + stage.first;
+                status.message = "latency in ms";
+                status.values.push_back(_keyValue("calls", histogram.size()));
+                status.values.push_back(_keyValue("mean", 1e3*histogram.mean()));
+                status.values.push_back(_keyValue("p50", 1e3*histogram.percentile(0.5)));
+                status.values.push_back(_keyValue("p99", 1e3*histogram.percentile(0.99)));
+                status.values.push_back(_keyValue("max", 1e3*histogram.max()));
+                statuses.push_back(status);
+                stage.second.clear();
+            }
+            StageStatus status;
+            status.name = name + ": counts";
+            status.message = "mean and max per scan";
+            for (auto &counter : counters){
+                double mean = counter.second.samples > 0 ? (double) counter.second.sum / counter.second.samples : 0;
+                status.values.push_back(_keyValue(counter.first + " mean", mean));
+                status.values.push_back(_keyValue(counter.first + " max", counter.second.maximum));
+                counter.second = Counter();
+            }
+            statuses.push_back(status);
+        }
+
+    private:
+        struct Counter
+        {
+            uint64_t samples = 0, sum = 0, maximum = 0;
+        };
+
+        std::mutex mtx;
+        std::map<std::string, LatencyHistogram> stages;
+        std::map<std::string, Counter> counters;
+
+        template <typename T>
+        static std::pair<std::string, std::string> _keyValue(const std::string &key, T value)
+        {
+            std::ostringstream stream;
+            stream << value;
+            return std::make_pair(key, stream.str());
+        }
+};
+
+// Times the enclosing scope
+class ScopedStageTimer
+{
+    public:
+        ScopedStageTimer(StageProfiler &profiler, const char *stage)
+            : profiler(profiler), stage(stage), start(std::chrono::steady_clock::now()) {}
+
+        ~ScopedStageTimer()
+        {
+            profiler.record(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+        StageProfiler &profiler;
+        const char *stage;
+        std::chrono::steady_clock::time_point start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_STAGE(profiler, stage) ScopedStageTimer PROFILE_CONCAT(stageTimer, __LINE__)(profiler, stage)
+#define PROFILE_COUNT(profiler, name, n) (profiler).count(name, n)
+
+#else
+
+#define PROFILE_STAGE(profiler, stage) ((void) 0)
+#define PROFILE_COUNT(profiler, name, n) ((void) 0)
+
+#endif
+#endif
@@ -0,0 +1,120 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef TUNNEL_SIMULATOR //usd for conditional compiling.
+#define TUNNEL_SIMULATOR
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// Scenario and sensors, the defaults follow simulator_matlab (setLidarParameters.m, setImuParameters.m, addGNSS.m)
+struct TunnelSimulatorParameters
+{
+    // Tunnel: "straight", "curved" (alternating bends) or "loop" (a ring driven past its start)
+    std::string shape = "straight";
+    double length = 1000; // m, along the centre line
+    double width = 10; // m, between the walls
+    double height = 7; // m, floor to the top of the arched roof, at least width/2
+    double curveRadius = 300; // m, of the bends in the curved tunnel
+    double curveLength = 200; // m, of each bend
+    double ribSpacing = 12; // m, mean distance between support ribs, they give the walls structure along the tunnel
+    double ribDepth = 0.3, ribWidth = 0.6; // m
+    double loopRevisit = 100; // m, driven past the start of the loop
+    double approach = 20; // m, driven in the open before and after the tunnel
+
+    // Vehicle
+    double speed = 1.5; // m/s
+    double acceleration = 0.5; // m/s^2, from standstill
+    double sensorHeight = 1.8; // m, above the floor
+    double laneOffset = -1.5; // m, left of the centre line
+
+    // Lidar, front bumper
+    double horizontalResolution = 0.16, verticalResolution = 1.25; // deg
+    double horizontalFov = 180, verticalFov = 40; // deg
+    double maxRange = 50; // m
+    double rangeNoise = 0.01; // m, standard deviation
+    double scanFrequency = 5; // Hz
+
+    // IMU, noise densities per sqrt(Hz) and bias random walks
+    double imuFrequency = 100; // Hz
+    double accelerometerNoise = 0.003924, accelerometerBiasWalk = 0.0015398;
+    double gyroscopeNoise = 8.7266e-05, gyroscopeBiasWalk = 3.24e-05;
+    double gravity = 9.8; // m/s^2, as in the preintegration parameters
+
+    // GNSS, only outside the tunnel
+    double gnssPeriod = 1.5; // s
+    double gnssNoiseHorizontal = 0.32, gnssNoiseVertical = 0.45; // m, standard deviation
+
+    unsigned int seed = 1;
+};
+
+// Sets one parameter from a "key=value" argument, false if the key is unknown or the value does not parse
+bool setSimulatorParameter(TunnelSimulatorParameters &parameters, const std::string &argument);
+
+// Generates tunnel scenarios without the MATLAB/Unreal setup: a centre line of straight and
+// circular segments, swept with a horseshoe cross-section (vertical walls and a half-circle
+// roof), driven at the sensor height. Scans are ray cast by sphere tracing against that shape.
+// Poses are in the frame of the first sensor pose, x forward, y left and z up, like the graph.
+class TunnelSimulator
+{
+    public:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        TunnelSimulator(const TunnelSimulatorParameters &parameters = TunnelSimulatorParameters());
+
+        double duration() const { return tEnd; }
+
+        // Sensor pose and velocity in the world at time t
+        Eigen::Isometry3d pose(double t) const;
+        Eigen::Vector3d velocity(double t) const;
+
+        // Organized scan, one row per vertical beam, NaN where nothing is hit within range
+        void scan(double t, pcl::PointCloud<pcl::PointXYZ> &cloud);
+        // Specific force and angular rate in the sensor frame, call at the IMU rate in time order
+        void imu(double t, Eigen::Vector3d &acceleration, Eigen::Vector3d &angularVelocity);
+        // Position fix, false while the sensor is inside the tunnel
+        bool gnss(double t, Eigen::Vector3d &position);
+
+    private:
+        // Straight segments have zero curvature, arcs turn left for positive curvature
+        struct Segment
+        {
+            double s0, length, curvature;
+            Eigen::Vector2d start;
+            double heading;
+        };
+        struct Projection
+        {
+            double s, lateral; // Along the centre line and left of it
+            double curvature;
+        };
+
+        TunnelSimulatorParameters p;
+        std::vector<Segment> segments; // Tunnel, then the open road before and after it
+        int nTunnelSegments;
+        bool loop;
+        double tunnelLength, pathStart, pathEnd; // Tunnel covers s in [0, tunnelLength], the path runs past it
+        double rampTime, rampLength, tEnd;
+        double halfWidth, wallHeight;
+        Eigen::Isometry3d worldFromCentreLine; // Puts the first sensor pose at the origin
+        std::vector<double> ribs; // Along the centre line
+        std::vector<int> nearbySegments; // Segments within range of the current scan
+        std::mt19937 rng;
+        Eigen::Vector3d accelerometerBias = Eigen::Vector3d::Zero(), gyroscopeBias = Eigen::Vector3d::Zero();
+        double lastImuTime = -1;
+
+        double _arcLength(double t) const; // Along the path
+        double _speed(double t) const;
+        void _centreLine(double s, Eigen::Vector2d &point, double &heading, double &curvature) const;
+        bool _project(const Segment &segment, const Eigen::Vector2d &point, Projection &projection) const;
+        Eigen::Isometry3d _poseInCentreLine(double s) const;
+        double _insideDistance(const Eigen::Vector3d &point) const; // Lower bound on the distance to the walls, negative outside
+        double _castRay(const Eigen::Vector3d &origin, const Eigen::Vector3d &direction) const;
+        double _profileDistance(double lateral, double up, double halfWidth) const;
+        double _ribDistance(double s) const; // Along the centre line to the nearest rib, 0 inside one
+};
+#endif
@@ -0,0 +1,101 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef VOXEL_HASH_FILTER //usd for conditional compiling.
+#define VOXEL_HASH_FILTER
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/common/centroid.h>
+
+#include "point_array_view.hpp"
+
+// Voxel downsampling in a single pass. Non-finite points are skipped, the rest are binned in a
+// hash table of voxels and each occupied voxel is replaced by the centroid of its points. Normals
+// and curvature are averaged as well when the point type has them. The table and the
+// accumulators are kept between calls, so filtering into a reused output does not allocate.
+template <typename PointT>
+class VoxelHashFilter
+{
+    public:
+        VoxelHashFilter(float leafSize = 0.1) { setLeafSize(leafSize); }
+
+        void setLeafSize(float leafSize) { inverseLeafSize = 1.0f / leafSize; }
+        float getLeafSize() const { return 1.0f / inverseLeafSize; }
+
+        void filter(const pcl::PointCloud<PointT> &input, pcl::PointCloud<PointT> &output)
+        {
+            _begin(input.size());
+            for (const auto &point : input.points){
+                _add(point);
+            }
+            _end(output);
+        }
+
+        // Reads straight from the point array, so NaN removal, copying and downsampling is one pass
+        void filter(const PointArrayView &input, pcl::PointCloud<PointT> &output)
+        {
+            _begin(input.size());
+            PointT point;
+            for (std::size_t i = 0; i < input.size(); i++){
+                input.get(i, point.x, point.y, point.z);
+                _add(point);
+            }
+            _end(output);
+        }
+
+    private:
+        float inverseLeafSize;
+        std::unordered_map<uint64_t, int> voxels; // Voxel key to accumulator
+        std::vector<pcl::CentroidPoint<PointT> > accumulators;
+        int nOccupied = 0;
+
+        // 21 bits per axis, which covers +-1e6 voxels around the origin
+        inline uint64_t _key(float x, float y, float z) const
+        {
+            const int64_t offset = 1 << 20;
+            uint64_t ix = (uint64_t) (static_cast<int64_t>(std::floor(x*inverseLeafSize)) + offset) & 0x1FFFFF;
+            uint64_t iy = (uint64_t) (static_cast<int64_t>(std::floor(y*inverseLeafSize)) + offset) & 0x1FFFFF;
+            uint64_t iz = (uint64_t) (static_cast<int64_t>(std::floor(z*inverseLeafSize)) + offset) & 0x1FFFFF;
+            return (ix << 42) | (iy << 21) | iz;
+        }
+
+        void _begin(std::size_t nPoints)
+        {
+            voxels.clear(); // Keeps the buckets
+            voxels.reserve(nPoints);
+            nOccupied = 0;
+        }
+
+        inline void _add(const PointT &point)
+        {
+            if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+                return;
+            auto inserted = voxels.insert(std::make_pair(_key(point.x, point.y, point.z), nOccupied));
+            if (inserted.second){
+                if (nOccupied < (int) accumulators.size())
+                    accumulators[nOccupied] = pcl::CentroidPoint<PointT>();
+                else
+                    accumulators.push_back(pcl::CentroidPoint<PointT>());
+                nOccupied++;
+            }
+            accumulators[inserted.first->second].add(point);
+        }
+
+        void _end(pcl::PointCloud<PointT> &output)
+        {
+            output.resize(nOccupied);
+            for (int i = 0; i < nOccupied; i++){
+                accumulators[i].get(output.points[i]);
+            }
+            output.width = nOccupied;
+            output.height = 1;
+            output.is_dense = true;
+        }
+};
+#endif
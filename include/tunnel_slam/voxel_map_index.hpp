@@ -0,0 +1,179 @@
+// Declaration file
+
+#pragma once //designed to include the current source file only once in a single compilation.
+#ifndef VOXEL_MAP_INDEX //usd for conditional compiling.
+#define VOXEL_MAP_INDEX
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+#include <Eigen/Core>
+
+// Spatial index over a growing map. Points are binned in a hash table of cubic cells under the id
+// the caller gives them, normally their index in the map cloud, and can be inserted, moved and
+// removed one at a time, so the index lives as long as the map instead of being rebuilt for every
+// query. Searches only look at the cells the search ball overlaps, which keeps them independent of
+// the map size. Works best with the cell size close to the search radius. Not thread safe, the
+// owner guards it with the map.
+class VoxelMapIndex
+{
+    public:
+        VoxelMapIndex(float cellSize = 1.0f) { setCellSize(cellSize); }
+
+        // Clears the index
+        void setCellSize(float cellSize)
+        {
+            inverseCellSize = 1.0f / cellSize;
+            clear();
+        }
+        float getCellSize() const { return 1.0f / inverseCellSize; }
+
+        void clear()
+        {
+            cells.clear();
+            positions.clear();
+            cellKeys.clear();
+            present.clear();
+            nPoints = 0;
+        }
+
+        std::size_t size() const { return nPoints; }
+        bool contains(int id) const { return id >= 0 && id < (int) present.size() && present[id]; }
+
+        // Inserts the point under id, or moves it there if the id is already indexed. Non-finite points are ignored.
+        void insert(int id, const Eigen::Vector3f &point)
+        {
+            if (!point.allFinite() || id < 0)
+                return;
+            if (contains(id)){
+                uint64_t key = _key(point);
+                positions[id] = point;
+                if (key != cellKeys[id]){
+                    _unlink(id);
+                    cellKeys[id] = key;
+                    cells[key].push_back(id);
+                }
+                return;
+            }
+            if (id >= (int) present.size()){
+                positions.resize(id + 1);
+                cellKeys.resize(id + 1);
+                present.resize(id + 1, false);
+            }
+            positions[id] = point;
+            cellKeys[id] = _key(point);
+            present[id] = true;
+            cells[cellKeys[id]].push_back(id);
+            nPoints++;
+        }
+
+        void remove(int id)
+        {
+            if (!contains(id))
+                return;
+            _unlink(id);
+            present[id] = false;
+            nPoints--;
+        }
+
+        // Closest point within maxDistance, -1 if there is none
+        int nearest(const Eigen::Vector3f &query, float maxDistance, float *squaredDistance = NULL) const
+        {
+            int best = -1;
+            float bestSquared = maxDistance*maxDistance;
+            _forCellsAround(query, maxDistance, [&](const std::vector<int> &ids){
+                for (int id : ids){
+                    float squared = (positions[id] - query).squaredNorm();
+                    if (squared <= bestSquared){
+                        bestSquared = squared;
+                        best = id;
+                    }
+                }
+                return true;
+            });
+            if (squaredDistance != NULL && best >= 0)
+                *squaredDistance = bestSquared;
+            return best;
+        }
+
+        // True if any point lies within radius, stops at the first one
+        bool anyWithin(const Eigen::Vector3f &query, float radius) const
+        {
+            return anyWithin(query, radius, [](int){ return true; });
+        }
+
+        // Only counts the points whose id the predicate accepts
+        template <typename Predicate>
+        bool anyWithin(const Eigen::Vector3f &query, float radius, Predicate accept) const
+        {
+            const float squaredRadius = radius*radius;
+            bool found = false;
+            _forCellsAround(query, radius, [&](const std::vector<int> &ids){
+                for (int id : ids){
+                    if ((positions[id] - query).squaredNorm() <= squaredRadius && accept(id)){
+                        found = true;
+                        return false;
+                    }
+                }
+                return true;
+            });
+            return found;
+        }
+
+    private:
+        float inverseCellSize;
+        std::unordered_map<uint64_t, std::vector<int> > cells; // Cell key to the ids in it
+        std::vector<Eigen::Vector3f> positions; // By id
+        std::vector<uint64_t> cellKeys; // By id
+        std::vector<bool> present; // By id
+        std::size_t nPoints = 0;
+
+        // 21 bits per axis as in VoxelHashFilter
+        static uint64_t _pack(int64_t ix, int64_t iy, int64_t iz)
+        {
+            const int64_t offset = 1 << 20;
+            return (((uint64_t) (ix + offset) & 0x1FFFFF) << 42) | (((uint64_t) (iy + offset) & 0x1FFFFF) << 21) | ((uint64_t) (iz + offset) & 0x1FFFFF);
+        }
+
+        inline int64_t _cell(float coordinate) const { return static_cast<int64_t>(std::floor(coordinate*inverseCellSize)); }
+        inline uint64_t _key(const Eigen::Vector3f &point) const { return _pack(_cell(point.x()), _cell(point.y()), _cell(point.z())); }
+
+        void _unlink(int id)
+        {
+            auto cell = cells.find(cellKeys[id]);
+            if (cell == cells.end())
+                return;
+            std::vector<int> &ids = cell->second;
+            auto it = std::find(ids.begin(), ids.end(), id);
+            if (it != ids.end()){
+                *it = ids.back();
+                ids.pop_back();
+            }
+            if (ids.empty())
+                cells.erase(cell);
+        }
+
+        // Calls visit with the ids of every occupied cell the ball overlaps, until it returns false
+        template <typename Visitor>
+        void _forCellsAround(const Eigen::Vector3f &query, float radius, Visitor visit) const
+        {
+            if (!query.allFinite())
+                return;
+            const int64_t x0 = _cell(query.x() - radius), x1 = _cell(query.x() + radius);
+            const int64_t y0 = _cell(query.y() - radius), y1 = _cell(query.y() + radius);
+            const int64_t z0 = _cell(query.z() - radius), z1 = _cell(query.z() + radius);
+            for (int64_t ix = x0; ix <= x1; ix++){
+                for (int64_t iy = y0; iy <= y1; iy++){
+                    for (int64_t iz = z0; iz <= z1; iz++){
+                        auto cell = cells.find(_pack(ix, iy, iz));
+                        if (cell != cells.end() && !visit(cell->second))
+                            return;
+                    }
+                }
+            }
+        }
+};
+#endif
@@ -0,0 +1,187 @@
+// Scaling benchmark: drives the front-end and the graph in-process with synthetic tunnels of
+// increasing length and reports how graph latency and memory grow with it.
+//
+//     tunnel_slam_benchmark [lengths=100,1000,10000] [key=value ...]
+//
+// Other keys set the GraphParameters, e.g. fixed_lag=true, or else the simulator, see tunnel_slam_simulate. Every length is a fresh run
+// with the same seed. Memory is the resident size of the process at the end of a run, so the
+// lengths are run shortest first.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "feature_association.hpp"
+#include "graph.hpp"
+#include "tunnel_simulator.hpp"
+
+// Resident set size in MB, 0 where /proc is not available
+static double residentMegabytes()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)){
+        if (line.compare(0, 6, "VmRSS:") == 0){
+            std::istringstream stream(line.substr(6));
+            double kilobytes = 0;
+            stream >> kilobytes;
+            return kilobytes / 1024;
+        }
+    }
+    return 0;
+}
+
+static void runLength(const TunnelSimulatorParameters &parameters, const GraphParameters &graphParameters)
+{
+    TunnelSimulator simulator(parameters);
+    Graph graph(graphParameters);
+    int runsWithoutUpdate = 0;
+    std::vector<double> runOnceSeconds;
+    uint64_t nMatched = 0, nRejected = 0;
+
+    // Fed to the graph in step with the odometry, as in tunnel_slam_replay
+    std::mutex sensorMtx;
+    std::deque<std::pair<double, gtsam::Vector6> > imuQueue;
+    std::deque<std::pair<double, gtsam::Point3> > gnssQueue;
+    auto feedSensorsUntil = [&](double time){
+        std::lock_guard<std::mutex> lock(sensorMtx);
+        while (!imuQueue.empty() && imuQueue.front().first <= time){
+            graph.addImu(imuQueue.front().first, imuQueue.front().second);
+            imuQueue.pop_front();
+        }
+        while (!gnssQueue.empty() && gnssQueue.front().first <= time){
+            graph.addGnss(gnssQueue.front().first, gnssQueue.front().second);
+            gnssQueue.pop_front();
+        }
+    };
+
+    auto odometryCallback = [&](const ScanOdometry &odometry){
+        feedSensorsUntil(odometry.stamp);
+        const Eigen::Vector3d delta = odometry.transformation.translation();
+        bool stable = delta.allFinite() && delta.cwiseAbs().maxCoeff() <= 5 && std::fabs(delta.x()) + std::fabs(delta.y()) <= 7;
+        if (stable){
+            Eigen::Quaterniond rotation(odometry.transformation.rotation());
+            graph.addOdometry(odometry.stamp, gtsam::Pose3(gtsam::Rot3(rotation), gtsam::Point3(delta)));
+            nMatched++;
+        }
+        else {
+            nRejected++;
+        }
+        graph.addFeatureCloud(odometry.stamp, PointArrayView(odometry.featureCloud));
+        graph.addGroundPlane(odometry.stamp, PointArrayView(odometry.groundPlane));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        graph.runOnce(runsWithoutUpdate);
+        runOnceSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    };
+
+    FeatureAssociation featureAssociation(FeatureAssociationParameters(), odometryCallback);
+    std::thread refineThread(&Graph::runRefine, &graph);
+    std::thread loopClosureThread(&Graph::runLoopClosure, &graph);
+
+    // Same stamps as the bags of tunnel_slam_simulate
+    const double timeOffset = 1;
+    const double duration = simulator.duration();
+    const double scanPeriod = 1.0 / parameters.scanFrequency, imuPeriod = 1.0 / parameters.imuFrequency;
+    uint64_t nScans = 0, nImu = 0;
+    double nextGnss = 0, simulationSeconds = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (double t = 0; t <= duration; t = ++nScans*scanPeriod){
+        std::chrono::steady_clock::time_point simulationStart = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(sensorMtx);
+            for (; nImu*imuPeriod <= t; nImu++){
+                Eigen::Vector3d acceleration, angularVelocity;
+                simulator.imu(nImu*imuPeriod, acceleration, angularVelocity);
+                gtsam::Vector6 measurement;
+                measurement << acceleration, angularVelocity;
+                imuQueue.push_back(std::make_pair(timeOffset + nImu*imuPeriod, measurement));
+            }
+            for (; nextGnss <= t; nextGnss += parameters.gnssPeriod){
+                Eigen::Vector3d position;
+                if (simulator.gnss(nextGnss, position))
+                    gnssQueue.push_back(std::make_pair(timeOffset + nextGnss, gtsam::Point3(position)));
+            }
+        }
+        // A fresh cloud per scan, the front-end keeps a view of it until the scan is described
+        pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>());
+        simulator.scan(t, *cloud);
+        simulationSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - simulationStart).count();
+        featureAssociation.addScan(PointArrayView(cloud), timeOffset + t, true);
+    }
+    featureAssociation.flush();
+    feedSensorsUntil(std::numeric_limits<double>::infinity());
+    graph.runOnce(runsWithoutUpdate);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double memory = residentMegabytes();
+
+    graph.stop();
+    refineThread.join();
+    loopClosureThread.join();
+
+    std::vector<std::pair<double, gtsam::Pose3> > keyPoses;
+    graph.getKeyPoses(keyPoses);
+    Eigen::Vector3d truth = simulator.pose(duration).translation();
+    gtsam::Pose3 finalPose = graph.getCurrentPose();
+    double finalError = (gtsam::Vector3(finalPose.x(), finalPose.y(), finalPose.z()) - truth).norm();
+
+    std::sort(runOnceSeconds.begin(), runOnceSeconds.end());
+    auto percentile = [&](double p){
+        return runOnceSeconds.empty() ? 0 : 1e3*runOnceSeconds[std::min(runOnceSeconds.size() - 1, (std::size_t) (p*runOnceSeconds.size()))];
+    };
+    double mean = 0;
+    for (double runOnce : runOnceSeconds){
+        mean += runOnce;
+    }
+    mean = runOnceSeconds.empty() ? 0 : 1e3*mean / runOnceSeconds.size();
+
+    std::cout << parameters.shape << " " << parameters.length << " m: " << nScans << " scans in " << seconds << " s ("
+              << simulationSeconds << " s simulating), " << (seconds > 0 ? nScans / seconds : 0) << " scans/s" << std::endl;
+    std::cout << "  keyframes " << keyPoses.size() << ", map points " << graph.getMapSize() << ", resident " << memory << " MB" << std::endl;
+    std::cout << "  runOnce ms: mean " << mean << " p50 " << percentile(0.5) << " p99 " << percentile(0.99)
+              << " max " << (runOnceSeconds.empty() ? 0 : 1e3*runOnceSeconds.back()) << std::endl;
+    std::cout << "  odometry " << nMatched << " used, " << nRejected << " rejected, "
+              << featureAssociation.getRegistrationFailures() << " registration failures, final position error " << finalError << " m" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    TunnelSimulatorParameters parameters;
+    GraphParameters graphParameters;
+    std::vector<double> lengths = {100, 1000, 10000};
+    for (int i = 1; i < argc; i++){
+        std::string argument = argv[i];
+        if (argument.compare(0, 8, "lengths=") == 0){
+            lengths.clear();
+            std::istringstream stream(argument.substr(8));
+            std::string length;
+            while (std::getline(stream, length, ',')){
+                lengths.push_back(std::atof(length.c_str()));
+            }
+        }
+        else if (!setGraphParameter(graphParameters, argument) && !setSimulatorParameter(parameters, argument)){
+            std::cerr << "Unknown or invalid parameter " << argument << std::endl;
+            std::cerr << "usage: " << argv[0] << " [lengths=100,1000,10000] [shape=straight|curved|loop] [speed=1.5] [seed=1] [fixed_lag=false] [keyframe_factors=false] ..." << std::endl;
+            return 1;
+        }
+    }
+    std::sort(lengths.begin(), lengths.end());
+    if (lengths.empty() || lengths.front() <= 0 || parameters.speed <= 0 || parameters.scanFrequency <= 0 || parameters.imuFrequency <= 0 || parameters.gnssPeriod <= 0){
+        std::cerr << "Lengths, speed and the sensor rates must be positive" << std::endl;
+        return 1;
+    }
+
+    for (double length : lengths){
+        parameters.length = length;
+        runLength(parameters, graphParameters);
+    }
+    return 0;
+}
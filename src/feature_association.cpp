@@ -1,20 +1,27 @@
 #include "feature_association.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
 #include <pcl/ModelCoefficients.h>
 #include <pcl/sample_consensus/sac_model_plane.h>
 #include <pcl/sample_consensus/method_types.h>
 #include <pcl/segmentation/sac_segmentation.h>
 
-#include <pcl/filters/passthrough.h>
-#include <pcl/filters/extract_indices.h>
-#include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/filter.h>
 
 #include <pcl/features/normal_3d.h>
+#include <pcl/features/normal_3d_omp.h>
 #include <pcl/keypoints/iss_3d.h>
 #include <pcl/features/fpfh.h>
-#include <pcl/search/kdtree.h>
+#include <pcl/features/fpfh_omp.h>
+#include <pcl/common/io.h>
 
-#include <pcl/registration/correspondence_estimation.h>
+#include <pcl/search/flann_search.h>
+#include <pcl/search/impl/flann_search.hpp>
 #include <pcl/registration/correspondence_rejection_features.h>
 #include <pcl/registration/correspondence_rejection_sample_consensus.h>
 #include <pcl/registration/correspondence_rejection_trimmed.h>
@@ -24,112 +31,278 @@
 #include <pcl/registration/transformation_estimation_point_to_plane.h>
 #include <pcl/registration/gicp.h>
 
-#include <tf_conversions/tf_eigen.h>
-#include <tf/transform_broadcaster.h>
-#include <tf2_eigen/tf2_eigen.h>
-#include <nav_msgs/Odometry.h>
-
 
 //constructor method
-FeatureAssociation::FeatureAssociation(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+FeatureAssociation::FeatureAssociation(const FeatureAssociationParameters &parameters, const OdometryCallback &callback)
+    : FeatureAssociationParameters(parameters), odometryCallback(callback)
 {   
-    nh_ = nh;
-    ROS_INFO("Initializing Feature Association Node");
-
-    // Subscribers and publishers
-    subPointCloud2          = nh.subscribe<sensor_msgs::PointCloud2>("/points2", 32, &FeatureAssociation::pointCloud2Handler, this);
-    pubGroundPlaneCloud2    = nh.advertise<sensor_msgs::PointCloud2>("/groundPlanePointCloud", 32);
-    pubFeatureCloud2        = nh.advertise<sensor_msgs::PointCloud2>("/featurePointCloud", 32);
-    pubOdometry             = nh.advertise<nav_msgs::Odometry>("/lidarOdom", 32);
+    featureMode = featureModeName == "curvature" ? CURVATURE : ISS_FPFH;
+    scanBuffer = RingBuffer<ScanJob>(scanBufferSize, scanDropPolicy == "newest" ? RingBuffer<ScanJob>::DROP_NEWEST : RingBuffer<ScanJob>::DROP_OLDEST);
 
     // Variable initialization
-    prevTime = ros::Time::now();
+    LeafSizeController::Mode mode = LeafSizeController::modeFromString(leafSizeMode);
+    leafSizeController.configure(mode, mode == LeafSizeController::TIME_BUDGET ? timeBudget : (double) targetPoints, leafSize, minLeafSize, maxLeafSize);
+    // Gate, iterations, min inliers, min inlier ratio, max angle (rad) and height (m) change per scan
+    groundPlaneTracker.setParameters(groundDistanceThreshold, 3*groundDistanceThreshold, 3, 50, 0.2, 0.1, 0.2);
+
+    // The range image lookup tables are static and filled lazily, which is not thread safe
+    pcl::RangeImage::createLookupTables();
+
+    // Pipeline: several scans are described concurrently, matching runs in scan order on its own thread
+    for (int i = 0; i < nrOfWorkers; i++){
+        workers.push_back(std::thread(&FeatureAssociation::_describeLoop, this));
+    }
+    matchingThread = std::thread(&FeatureAssociation::_matchLoop, this);
 }
 
 // Destructor method
 FeatureAssociation::~FeatureAssociation()
 {
-
+    pipelineMtx.lock();
+    running = false;
+    pipelineMtx.unlock();
+    scanAvailable.notify_all();
+    featuresAvailable.notify_all();
+    scanTaken.notify_all();
+    scanMatched.notify_all();
+    groundPlaneTracker.stop();
+    for (auto &worker : workers){
+        worker.join();
+    }
+    matchingThread.join();
+    std::cout << "Ground plane tracked in " << groundPlaneTracker.getTracked() << " scans, fitted from scratch in " << groundPlaneTracker.getReinitialized() << std::endl;
+    std::cout << "Feature association received " << scanBuffer.getPushed() << " scans, dropped " << scanBuffer.getDropped() << std::endl;
 }
 
-void FeatureAssociation::pointCloud2Handler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+bool FeatureAssociation::addScan(const PointArrayView &scan, double stamp, bool wait)
 {   
-        pcl::fromROSMsg(*pointCloud2Msg, currentCloud);
-        currentTime = pointCloud2Msg->header.stamp;
-        newCloud=true;
+    // Only a view of the points is queued, they are read from the caller's array by the worker
+    ScanJob job;
+    job.stamp = stamp;
+    job.scan = scan;
+
+    std::unique_lock<std::mutex> lock(pipelineMtx);
+    if (wait)
+        scanTaken.wait(lock, [this]{ return !running || scanBuffer.size() < scanBuffer.capacity(); });
+    bool stored = scanBuffer.push(job);
+    lock.unlock();
+    // Wake a worker directly instead of waiting for a polling loop
+    scanAvailable.notify_one();
+    return stored;
 }
 
-void FeatureAssociation::_findGroundPlane(const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &groundPlane, pcl::PointCloud<pcl::PointNormal> &excludedGroundPlane)
+void FeatureAssociation::flush()
 {
-    // Filter to fit plane to points below the sensor
-
-    pcl::PointCloud<pcl::PointNormal>::Ptr potentialGroundPoints(new pcl::PointCloud<pcl::PointNormal>);
-    pcl::PassThrough<pcl::PointNormal> pass(true);
-    pass.setInputCloud(cloud.makeShared());
-    pass.setFilterFieldName("z");
-    pass.setNegative(false);
-    pass.setFilterLimits(-2, -0.1);
-    pass.filter(*potentialGroundPoints);
-    //std::cout << *excludedGround << std::endl;
-
-    pcl::IndicesConstPtr notGroundPtr = pass.getRemovedIndices();
-
-    pcl::SACSegmentation<pcl::PointNormal> sacGroundPlane;
-    sacGroundPlane.setInputCloud(potentialGroundPoints->makeShared());
-    sacGroundPlane.setOptimizeCoefficients(true);
-    sacGroundPlane.setModelType(pcl::SACMODEL_PLANE);
-    sacGroundPlane.setMethodType(pcl::SAC_RANSAC);
-    sacGroundPlane.setDistanceThreshold(0.1);
-
-    // Perform fit
-    pcl::ModelCoefficients coefficients;
-    pcl::PointIndices::Ptr inliers(new pcl::PointIndices());
-    sacGroundPlane.segment(*inliers, coefficients);
-    
-    // #TODO: Extract ground plane indices relative to original cloud and output ground plane 
+    // Sequence numbers are handed out when a worker takes a scan, so an empty buffer and every
+    // numbered scan matched means the pipeline is idle
+    std::unique_lock<std::mutex> lock(pipelineMtx);
+    scanMatched.wait(lock, [this]{ return !running || (scanBuffer.empty() && matchedScans == nextScanSeq); });
+}
 
-    groundPlane = pcl::PointCloud<pcl::PointNormal>(*potentialGroundPoints, inliers->indices);
-    
-    pcl::ExtractIndices<pcl::PointNormal> removeGroundPlaneFilter;
-    removeGroundPlaneFilter.setInputCloud(cloud.makeShared());
-    removeGroundPlaneFilter.setIndices(notGroundPtr);
-    removeGroundPlaneFilter.setNegative(false);
-    removeGroundPlaneFilter.filter(excludedGroundPlane); 
+bool FeatureAssociation::_findGroundPlane(uint64_t seq, const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &groundPlane, pcl::PointCloud<pcl::PointNormal> &excludedGroundPlane, Eigen::Vector4f &plane)
+{
+    PROFILE_STAGE(profiler, "ground_plane");
+    // Plane is fitted to points below the sensor, everything else is kept as non-ground
+    pcl::PointCloud<pcl::PointNormal>::Ptr potentialGroundPoints = pointPool.acquire();
+    potentialGroundPoints->reserve(cloud.size());
+    excludedGroundPlane.clear();
+    excludedGroundPlane.reserve(cloud.size());
+    for (const auto &point : cloud.points){
+        if (point.z >= -2 && point.z <= -0.1)
+            potentialGroundPoints->push_back(point);
+        else
+            excludedGroundPlane.push_back(point);
+    }
 
+    // Warm start from the plane of the previous scan in sequence, RANSAC only when tracking is lost
+    bool tracked = groundTrackingFlag && groundPlaneTracker.predict(seq, plane) && groundPlaneTracker.refine(*potentialGroundPoints, plane);
+    if (!tracked){
+        pcl::SACSegmentation<pcl::PointNormal> sacGroundPlane;
+        sacGroundPlane.setInputCloud(potentialGroundPoints);
+        sacGroundPlane.setOptimizeCoefficients(true);
+        sacGroundPlane.setModelType(pcl::SACMODEL_PLANE);
+        sacGroundPlane.setMethodType(pcl::SAC_RANSAC);
+        sacGroundPlane.setDistanceThreshold(groundDistanceThreshold);
+
+        // Perform fit
+        pcl::ModelCoefficients coefficients;
+        pcl::PointIndices inliers;
+        sacGroundPlane.segment(inliers, coefficients);
+        if (coefficients.values.size() != 4){
+            groundPlaneTracker.lose(seq);
+            groundPlane.clear();
+            return false;
+        }
+        plane = Eigen::Vector4f(coefficients.values[0], coefficients.values[1], coefficients.values[2], coefficients.values[3]);
+        plane /= plane.head<3>().norm();
+        if (plane.z() < 0)
+            plane = -plane; // Towards the sensor, which is above the ground
+    }
+    groundPlaneTracker.update(seq, plane, tracked);
+
+    groundPlane.clear();
+    groundPlane.reserve(potentialGroundPoints->size());
+    for (const auto &point : potentialGroundPoints->points){
+        if (std::fabs(plane.head<3>().dot(point.getVector3fMap()) + plane[3]) <= groundDistanceThreshold)
+            groundPlane.push_back(point);
+    }
+
+    // Without range image normals the ground points are not given normals upstream, use the plane normal
+    if (!rangeImageNormalsFlag){
+        for (auto &point : groundPlane.points){
+            point.getNormalVector3fMap() = plane.head<3>();
+        }
+    }
+    return true;
 }
 
-void FeatureAssociation::_extractFeatures(const pcl::PointCloud<pcl::PointNormal> &cloud, pcl::PointCloud<pcl::PointNormal> &output, pcl::PointCloud<pcl::FPFHSignature33> &descriptors)
+void FeatureAssociation::_extractFeatures(const FeatureContext &context, pcl::PointCloud<pcl::PointNormal> &output, pcl::PointCloud<pcl::FPFHSignature33> &descriptors)
 {      
 
     //Extract keypoints
+    PROFILE_STAGE(profiler, "iss_fpfh");
     pcl::ISSKeypoint3D<pcl::PointNormal, pcl::PointNormal> keypointDetector; // Possible to do this after processing if you pass original cloud to setsearchsurface()
-    keypointDetector.setInputCloud(cloud.makeShared());
-    keypointDetector.setSalientRadius(leafSize*5);
-    keypointDetector.setNonMaxRadius(leafSize*3);
+    keypointDetector.setInputCloud(context.surface);
+    keypointDetector.setSearchMethod(context.tree);
+    keypointDetector.setSalientRadius(context.leafSize*5);
+    keypointDetector.setNonMaxRadius(context.leafSize*3);
     keypointDetector.setThreshold21(0.8);
     keypointDetector.setThreshold32(0.8);
-    keypointDetector.setNormalRadius(normalRadius); //#TODO: find a way to use precalculated normals
-    //keypointDetector.setNormals(test->);
-    keypointDetector.compute(output);
-
-    //Calculate FPFH descriptors
-    pcl::PointCloud<pcl::FPFHSignature33> fullCloudDescriptors;
-    pcl::search::KdTree<pcl::PointNormal>::Ptr tree (new pcl::search::KdTree<pcl::PointNormal>);
-    pcl::FPFHEstimation<pcl::PointNormal, pcl::PointNormal, pcl::FPFHSignature33> fpfhEstimator;
-    fpfhEstimator.setInputCloud(cloud.makeShared());
-    fpfhEstimator.setInputNormals(cloud.makeShared());
-    fpfhEstimator.setSearchMethod(tree);
-    fpfhEstimator.setRadiusSearch(normalRadius*2);
-    fpfhEstimator.compute(fullCloudDescriptors);
-
-    //Only extract descriptors from the keypoints
-    pcl::ExtractIndices<pcl::FPFHSignature33> keypointExtractor;
-    keypointExtractor.setInputCloud(fullCloudDescriptors.makeShared());
-    keypointExtractor.setIndices(keypointDetector.getKeypointsIndices());
-    keypointExtractor.filter(descriptors);
+    keypointDetector.setNormals(context.surface);
+    keypointDetector.setNumberOfThreads(threadsPerStage);
+    {
+        PROFILE_STAGE(profiler, "iss");
+        keypointDetector.compute(output);
+    }
+    PROFILE_COUNT(profiler, "keypoints", output.size());
+
+    //Calculate FPFH descriptors at the keypoints only, the full cloud is used as search surface
+    pcl::FPFHEstimationOMP<pcl::PointNormal, pcl::PointNormal, pcl::FPFHSignature33> fpfhEstimator(threadsPerStage);
+    fpfhEstimator.setInputCloud(context.surface);
+    fpfhEstimator.setIndices(keypointDetector.getKeypointsIndices());
+    fpfhEstimator.setInputNormals(context.surface);
+    fpfhEstimator.setSearchMethod(context.tree);
+    fpfhEstimator.setRadiusSearch(context.normalRadius*2);
+    {
+        PROFILE_STAGE(profiler, "fpfh");
+        fpfhEstimator.compute(descriptors);
+    }
+}
+
+bool FeatureAssociation::_describeKeypoints(const FeatureContext &context, pcl::PointCloud<pcl::PointNormal>::Ptr &keypoints, pcl::PointCloud<pcl::FPFHSignature33>::Ptr &descriptors, DescriptorIndexPtr &descriptorIndex)
+{
+    keypoints = pointPool.acquire();
+    descriptors = descriptorPool.acquire();
+    _extractFeatures(context, *keypoints, *descriptors);
+    if (descriptors->points.size() < minNrOfFeatures)
+        return false;
+    PROFILE_STAGE(profiler, "descriptor_index");
+    descriptorIndex = _buildDescriptorIndex(descriptors);
+    return true;
+}
+
+bool FeatureAssociation::_ensureDescriptors(ScanFeatures &features)
+{
+    // In the curvature mode the descriptors of both scans are computed here, on the first failed fast path
+    if (!features.descriptorIndex && !_describeKeypoints(features.context, features.keypoints, features.descriptors, features.descriptorIndex))
+        return false;
+    if (!_prevDescriptorIndex){
+        pcl::PointCloud<pcl::PointNormal>::Ptr keypoints;
+        pcl::PointCloud<pcl::FPFHSignature33>::Ptr descriptors;
+        if (!_prevContext.surface || !_describeKeypoints(_prevContext, keypoints, descriptors, _prevDescriptorIndex)){
+            _prevDescriptorIndex.reset();
+            return false;
+        }
+        _prevKeypoints = keypoints;
+        _prevFeatureDescriptor = descriptors;
+    }
+    return true;
+}
+
+void FeatureAssociation::_extractCurvatureFeatures(const ScanBuffers &buffers, bool groundFound, const Eigen::Vector4f &groundCoefficients, pcl::PointCloud<pcl::PointNormal> &output)
+{
+    PROFILE_STAGE(profiler, "curvature_features");
+    // Smoothness of each point along its ring, as in LOAM: the sharpest points of a sector are edges and the smoothest are planar
+    const pcl::RangeImage &rangeImage = buffers.rangeImage;
+    int width = rangeImage.width, height = rangeImage.height;
+    int K = curvatureHalfWindow;
+    bool haveNormals = (int) buffers.validNormal.size() == width*height;
+    output.clear();
+    output.reserve(height*curvatureSectors*(maxEdgesPerSector + maxPlanarPerSector));
+    if (width <= 2*K)
+        return;
+
+    std::vector<std::pair<float, int> > scored; // Curvature, column
+    std::vector<char> picked(width);
+    auto addFeature = [&](int x, int y){
+        pcl::PointNormal feature;
+        feature.getVector3fMap() = rangeImage.getPoint(x, y).getVector3fMap();
+        if (haveNormals && buffers.validNormal[y*width + x]){
+            feature.getNormalVector3fMap() = buffers.imageWithNormals.points[y*width + x].getNormalVector3fMap();
+            feature.curvature = buffers.imageWithNormals.points[y*width + x].curvature;
+        }
+        else {
+            feature.normal_x = feature.normal_y = feature.normal_z = feature.curvature = std::numeric_limits<float>::quiet_NaN();
+        }
+        output.push_back(feature);
+        std::fill(picked.begin() + std::max(0, x - K), picked.begin() + std::min(width, x + K + 1), 1);
+    };
+    for (int y = 0; y < height; y++){
+        std::fill(picked.begin(), picked.end(), 0);
+        for (int sector = 0; sector < curvatureSectors; sector++){
+            int begin = K + (width - 2*K)*sector/curvatureSectors;
+            int end = K + (width - 2*K)*(sector + 1)/curvatureSectors;
+            scored.clear();
+            for (int x = begin; x < end; x++){
+                if (!rangeImage.isValid(x, y))
+                    continue;
+                const pcl::PointWithRange &center = rangeImage.getPoint(x, y);
+                // Floor points belong to the ground plane cloud
+                if (groundFound && std::fabs(groundCoefficients.head<3>().dot(center.getVector3fMap()) + groundCoefficients[3]) <= groundDistanceThreshold)
+                    continue;
+                Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+                bool complete = true;
+                for (int k = -K; k <= K && complete; k++){
+                    if (k == 0)
+                        continue;
+                    if (!rangeImage.isValid(x+k, y)){
+                        complete = false;
+                        break;
+                    }
+                    const pcl::PointWithRange &neighbour = rangeImage.getPoint(x+k, y);
+                    // Occlusion borders look sharp but do not exist in the next scan
+                    if ((k == -1 || k == 1) && std::fabs(neighbour.range - center.range) > curvatureMaxRangeJump*center.range)
+                        complete = false;
+                    sum += neighbour.getVector3fMap() - center.getVector3fMap();
+                }
+                if (!complete)
+                    continue;
+                scored.push_back(std::make_pair(sum.squaredNorm() / (center.range*center.range), x));
+            }
+            std::sort(scored.begin(), scored.end());
+
+            // Selected points suppress their ring neighbours, which spreads the features over the sector
+            int nEdges = 0;
+            for (int i = (int) scored.size() - 1; i >= 0 && nEdges < maxEdgesPerSector && scored[i].first > edgeThreshold; i--){
+                int x = scored[i].second;
+                if (picked[x])
+                    continue;
+                addFeature(x, y);
+                nEdges++;
+            }
+            int nPlanar = 0;
+            for (int i = 0; i < (int) scored.size() && nPlanar < maxPlanarPerSector && scored[i].first < planarThreshold; i++){
+                int x = scored[i].second;
+                if (picked[x])
+                    continue;
+                addFeature(x, y);
+                nPlanar++;
+            }
+        }
+    }
 }
 
-pcl::RangeImage FeatureAssociation::_pointCloud2RangeImage(const pcl::PointCloud<pcl::PointNormal> &cloud)
+void FeatureAssociation::_pointCloud2RangeImage(const pcl::PointCloud<pcl::PointXYZ> &cloud, pcl::RangeImage &rangeImage)
 {
     
     // SENSOR SPECIFIC
@@ -148,36 +321,71 @@ pcl::RangeImage FeatureAssociation::_pointCloud2RangeImage(const pcl::PointCloud
     float minRange      = 0.0f;
     int borderSize      = 1;
 
-    // Create Range Image
+    // Create Range Image, into the image of the previous scan to keep its buffer
 
-    pcl::RangeImage rangeImage;
     rangeImage.createFromPointCloud(cloud, angularResolutionX, angularResolutionY, maxAngleWidth, maxAngleHeight, sensorPose, coordinate_frame, noiseLevel, minRange, borderSize);
-    return rangeImage;
 
 }
 
 void FeatureAssociation::_warpPoints() //#TODO
 {
-    double timeDiff = currentTime.toSec() - prevTime.toSec();
+    double timeDiff = scanTime - prevTime;
     double zPrev = transformation.rotation().eulerAngles(0, 1, 2).z();
 }
 
-void FeatureAssociation::_calculateTransformation(const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud, const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::FPFHSignature33> &featureDescriptors)
+DescriptorIndexPtr FeatureAssociation::_buildDescriptorIndex(const pcl::PointCloud<pcl::FPFHSignature33>::Ptr &descriptors) const
+{
+    // Built once per scan, used as source now and as target when the next scan is matched
+    DescriptorIndexPtr index;
+    if (approximateDescriptorSearchFlag){
+        typedef pcl::search::FlannSearch<pcl::FPFHSignature33, flann::L2<float> > DescriptorForest;
+        DescriptorForest::FlannIndexCreatorPtr forestCreator(new DescriptorForest::KdTreeMultiIndexCreator(descriptorForestTrees));
+        boost::shared_ptr<DescriptorForest> forest(new DescriptorForest(false, forestCreator));
+        forest->setChecks(descriptorSearchChecks);
+        index = forest;
+    }
+    else {
+        index.reset(new pcl::search::KdTree<pcl::FPFHSignature33>(false));
+    }
+    index->setInputCloud(descriptors);
+    return index;
+}
+
+void FeatureAssociation::_matchDescriptors(const pcl::PointCloud<pcl::FPFHSignature33> &source, const DescriptorIndexPtr &sourceIndex, const pcl::PointCloud<pcl::FPFHSignature33> &target, const DescriptorIndexPtr &targetIndex, pcl::Correspondences &correspondences)
+{
+    // Reciprocal nearest neighbours in descriptor space
+    std::vector<int> index(1), reciprocalIndex(1);
+    std::vector<float> squaredDistance(1), reciprocalSquaredDistance(1);
+    correspondences.clear();
+    correspondences.reserve(source.size());
+    for (int i = 0; i < (int) source.size(); i++){
+        if (!pcl_isfinite(source.points[i].histogram[0]))
+            continue;
+        if (targetIndex->nearestKSearch(source.points[i], 1, index, squaredDistance) < 1)
+            continue;
+        if (sourceIndex->nearestKSearch(target.points[index[0]], 1, reciprocalIndex, reciprocalSquaredDistance) < 1 || reciprocalIndex[0] != i)
+            continue;
+        correspondences.push_back(pcl::Correspondence(i, index[0], squaredDistance[0]));
+    }
+}
+
+void FeatureAssociation::_calculateTransformation(const pcl::PointCloud<pcl::PointNormal>::ConstPtr &groundPlaneCloud, const pcl::PointCloud<pcl::PointNormal>::ConstPtr &featureCloud, const pcl::PointCloud<pcl::FPFHSignature33>::ConstPtr &featureDescriptors, const DescriptorIndexPtr &descriptorIndex)
 {   
     
-    // Find correspondences
+    // Find correspondences, with the descriptor indices kept from when the scans were described
     pcl::CorrespondencesPtr allCorrespondences(new pcl::Correspondences);
-    pcl::registration::CorrespondenceEstimation<pcl::FPFHSignature33, pcl::FPFHSignature33> matcher;
-    
-    matcher.setInputSource(featureDescriptors.makeShared());
-    matcher.setInputTarget(_prevFeatureDescriptor.makeShared());
-    matcher.determineReciprocalCorrespondences(*allCorrespondences);    
+    {
+        PROFILE_STAGE(profiler, "descriptor_matching");
+        _matchDescriptors(*featureDescriptors, descriptorIndex, *_prevFeatureDescriptor, _prevDescriptorIndex, *allCorrespondences);
+    }
+    PROFILE_COUNT(profiler, "correspondences", allCorrespondences->size());
 
     // Rejection step
     pcl::CorrespondencesPtr partialOverlapCorrespondences (new pcl::Correspondences);
 
     pcl::CorrespondencesPtr goodCorrespondences (new pcl::Correspondences);
 
+    PROFILE_STAGE(profiler, "rejection");
     pcl::registration::CorrespondenceRejectorTrimmed trimmer;
     trimmer.setInputCorrespondences(allCorrespondences);
     trimmer.setOverlapRatio(0.5);
@@ -185,13 +393,14 @@ void FeatureAssociation::_calculateTransformation(const pcl::PointCloud<pcl::Poi
 
 
     pcl::registration::CorrespondenceRejectorSampleConsensus<pcl::PointNormal> rej;
-    rej.setInputSource(featureCloud.makeShared());
-    rej.setInputTarget(_prevFeatureCloud.makeShared());
+    rej.setInputSource(featureCloud);
+    rej.setInputTarget(_prevKeypoints);
     rej.setInlierThreshold(0.5);
     rej.setMaximumIterations(100);
     rej.setRefineModel(true);
     rej.setInputCorrespondences(partialOverlapCorrespondences);
     rej.getCorrespondences(*goodCorrespondences);
+    PROFILE_COUNT(profiler, "inlier_correspondences", goodCorrespondences->size());
 
     //Calculate transformation
     //pcl::registration::TransformationEstimationPointToPlane<pcl::PointNormal, pcl::PointNormal> tEst;
@@ -200,13 +409,14 @@ void FeatureAssociation::_calculateTransformation(const pcl::PointCloud<pcl::Poi
     Eigen::Matrix4f T;
 
 
-    tEst.estimateRigidTransformation(featureCloud, _prevFeatureCloud, *goodCorrespondences, T);
+    PROFILE_STAGE(profiler, "transformation_estimation");
+    tEst.estimateRigidTransformation(*featureCloud, *_prevKeypoints, *goodCorrespondences, T);
 
     /*Eigen::Matrix4f TFinal;
     pcl::PointCloud<pcl::PointNormal> alignedCloud;
     pcl::GeneralizedIterativeClosestPoint<pcl::PointNormal, pcl::PointNormal> gicp;
-    gicp.setInputSource(featureCloud.makeShared());
-    gicp.setInputTarget(_prevFeatureCloud.makeShared());
+    gicp.setInputSource(featureCloud);
+    gicp.setInputTarget(_prevKeypoints);
     gicp.align(alignedCloud, T);
     TFinal = gicp.getFinalTransformation();*/
 
@@ -217,155 +427,392 @@ void FeatureAssociation::_calculateTransformation(const pcl::PointCloud<pcl::Poi
     transformation = T.cast<double>();
 }
 
-void FeatureAssociation::_publishTransformation()
-{   
-    if (pubOdometry.getNumSubscribers() > 0){
-
-        double delta_x = transformation.translation().x();
-        double delta_y = transformation.translation().y();
-        double delta_z = transformation.translation().z();
-        
-        //Nans
-        if (isnan(delta_x) || isnan(delta_y) || isnan(delta_z))
-            return;
-        
-        // Unstable
-        if (abs(delta_x) > 5 || abs(delta_y) > 5 || abs(delta_z) > 5 || abs(delta_x) + abs(delta_y) > 7)
-            return;
-
-        geometry_msgs::TransformStamped tfMsg   = tf2::eigenToTransform(transformation);
-        tfMsg.header.stamp                      = currentTime;
-        tfMsg.header.frame_id                   = "odom";
-        tfMsg.child_frame_id                    = "map";
-
-        odomBroadcaster.sendTransform(tfMsg);
-
-        nav_msgs::Odometry odom;
-        odom.header.stamp       = currentTime;
-        odom.header.frame_id    = "odom";
-        
-        odom.pose.pose.position.x   = delta_x;
-        odom.pose.pose.position.y   = delta_y;
-        odom.pose.pose.position.z   = delta_z;
-        odom.pose.pose.orientation  = tfMsg.transform.rotation;
-
-        odom.child_frame_id = "map";
-
-        pubOdometry.publish(odom);
-    }
-
+void FeatureAssociation::_calculateNormals(const FeatureContext &context)
+{
+    PROFILE_STAGE(profiler, "normals");
+    //Calculate normals with the shared search tree, and write them into the surface
+    // Only the normal and curvature fields are written, so the surface can be its own output without a temporary cloud
+    pcl::NormalEstimationOMP<pcl::PointNormal, pcl::PointNormal> normalEstimator(threadsPerStage);
+    normalEstimator.setInputCloud(context.surface);
+    normalEstimator.setSearchMethod(context.tree);
+    normalEstimator.setRadiusSearch(context.normalRadius);
+    normalEstimator.compute(*context.surface);
 }
 
-void FeatureAssociation::_publishFeatureCloud(const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud)
+void FeatureAssociation::_calculateNormalsRangeImage(const pcl::PointCloud<pcl::PointXYZ> &cloud, float normalRadius, ScanBuffers &buffers, pcl::PointCloud<pcl::PointNormal> &cloudWithNormals)
 {
-    if (pubFeatureCloud2.getNumSubscribers() > 0){
-        sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(featureCloud, msg);
-        msg.header.stamp = currentTime;
-        msg.header.frame_id = "lidar";
-        pubFeatureCloud2.publish(msg);
+    PROFILE_STAGE(profiler, "normals");
+    // Organize the scan in the ring/column grid of the sensor once, and use the image adjacency as neighbourhood
+    pcl::RangeImage &rangeImage = buffers.rangeImage;
+    _pointCloud2RangeImage(cloud, rangeImage);
+
+    float squaredRadius = normalRadius*normalRadius;
+    int width = rangeImage.width, height = rangeImage.height;
+    pcl::PointCloud<pcl::PointNormal> &imageWithNormals = buffers.imageWithNormals;
+    imageWithNormals.resize(width*height); // Slots of invalid pixels are never read, no need to clear them
+    std::vector<char> &validNormal = buffers.validNormal;
+    validNormal.assign(width*height, 0);
+
+    #pragma omp parallel for num_threads(threadsPerStage) schedule(dynamic, 1)
+    for (int y = 0; y < height; y++){
+        for (int x = 0; x < width; x++){
+            if (!rangeImage.isValid(x, y))
+                continue;
+            Eigen::Vector3f center = rangeImage.getPoint(x, y).getVector3fMap();
+
+            // Accumulate the neighbourhood relative to the center point to keep the covariance well conditioned at long range
+            Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+            Eigen::Matrix3f sumSquared = Eigen::Matrix3f::Zero();
+            int neighbours = 0;
+            for (int dy = -rangeImageHalfWindowRows; dy <= rangeImageHalfWindowRows; dy++){
+                for (int dx = -rangeImageHalfWindowCols; dx <= rangeImageHalfWindowCols; dx++){
+                    if (!rangeImage.isValid(x+dx, y+dy))
+                        continue;
+                    Eigen::Vector3f d = rangeImage.getPoint(x+dx, y+dy).getVector3fMap() - center;
+                    if (d.squaredNorm() > squaredRadius)
+                        continue;
+                    sum += d;
+                    sumSquared += d*d.transpose();
+                    neighbours++;
+                }
+            }
+            // Validity mask: too few neighbours in the image window gives no reliable plane
+            if (neighbours < minNeighboursNormal)
+                continue;
+
+            Eigen::Vector3f mean = sum / neighbours;
+            Eigen::Matrix3f covariance = sumSquared / neighbours - mean*mean.transpose();
+
+            pcl::PointNormal &pointWithNormal = imageWithNormals.points[y*width + x];
+            pointWithNormal.x = center.x();
+            pointWithNormal.y = center.y();
+            pointWithNormal.z = center.z();
+            pcl::solvePlaneParameters(covariance, pointWithNormal.normal_x, pointWithNormal.normal_y, pointWithNormal.normal_z, pointWithNormal.curvature);
+            // Consistent orientation towards the sensor, so the normals can be averaged by the voxel filter
+            pcl::flipNormalTowardsViewpoint(pointWithNormal, 0.0f, 0.0f, 0.0f, pointWithNormal.normal_x, pointWithNormal.normal_y, pointWithNormal.normal_z);
+            validNormal[y*width + x] = 1;
+        }
     }
-    if (pubGroundPlaneCloud2.getNumSubscribers() > 0){
-        sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(groundPlaneCloud, msg);
-        msg.header.stamp = currentTime;
-        msg.header.frame_id = "lidar";
-        pubGroundPlaneCloud2.publish(msg);
+
+    cloudWithNormals.clear();
+    cloudWithNormals.reserve(imageWithNormals.size());
+    for (int i = 0; i < width*height; i++){
+        if (validNormal[i])
+            cloudWithNormals.push_back(imageWithNormals.points[i]);
     }
 }
 
-void FeatureAssociation::_publish(const pcl::PointCloud<pcl::PointNormal> &featureCloud, const pcl::PointCloud<pcl::PointNormal> &groundPlaneCloud)
-{   
-
-    _publishFeatureCloud(featureCloud, groundPlaneCloud);
-    _publishTransformation();
+void FeatureAssociation::_describeLoop()
+{
+    ScanBuffers buffers;
+    while (true){
+        ScanJob job;
+        ScanFeatures features;
+        {
+            std::unique_lock<std::mutex> lock(pipelineMtx);
+            scanAvailable.wait(lock, [this]{ return !running || !scanBuffer.empty(); });
+            if (!running)
+                return;
+            scanBuffer.pop(job);
+            // Sequence numbers are handed out in arrival order, so the matching stage can restore it
+            features.seq = nextScanSeq++;
+        }
+        scanTaken.notify_one();
+        features.stamp = job.stamp;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        {
+            PROFILE_STAGE(profiler, "describe_total");
+            _describeScan(job.scan, buffers, features);
+        }
+        groundPlaneTracker.skip(features.seq); // For scans that ended before the ground plane
+        leafSizeController.update(features.leafSize, features.nPoints, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
 
+        pipelineMtx.lock();
+        describedScans[features.seq] = features;
+        pipelineMtx.unlock();
+        featuresAvailable.notify_one();
+    }
 }
 
-void FeatureAssociation::_calculateNormals(const pcl::PointCloud<pcl::PointXYZ> &cloud, pcl::PointCloud<pcl::PointNormal> &cloudWithNormals)
+void FeatureAssociation::_matchLoop()
 {
-    //Calculate normals
-    pcl::PointCloud<pcl::Normal> fullCloudNormals;
-    pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> normalEstimator;
-    normalEstimator.setInputCloud(cloud.makeShared());
-    normalEstimator.setRadiusSearch(normalRadius);
-    normalEstimator.compute(fullCloudNormals);
-
-    for (int i = 0; i < cloud.points.size(); i++){
-        pcl::PointNormal pointWithNormal;
-        pointWithNormal.x = cloud.points[i].x;
-        pointWithNormal.y = cloud.points[i].y;
-        pointWithNormal.z = cloud.points[i].z;
-        pointWithNormal.normal_x = fullCloudNormals.points[i].normal_x;
-        pointWithNormal.normal_y = fullCloudNormals.points[i].normal_y;        pointWithNormal.normal_z = fullCloudNormals.points[i].normal_z;
-        cloudWithNormals.push_back(pointWithNormal);
+    while (true){
+        ScanFeatures features;
+        {
+            std::unique_lock<std::mutex> lock(pipelineMtx);
+            featuresAvailable.wait(lock, [this]{ return !running || (!describedScans.empty() && describedScans.begin()->first == nextMatchSeq); });
+            if (!running)
+                return;
+            features = describedScans.begin()->second;
+            describedScans.erase(describedScans.begin());
+            nextMatchSeq++;
+        }
+        {
+            PROFILE_STAGE(profiler, "match_total");
+            _matchScan(features);
+        }
+        pipelineMtx.lock();
+        matchedScans++;
+        pipelineMtx.unlock();
+        scanMatched.notify_all();
     }
 }
 
-void FeatureAssociation::runOnce()
-{   
-    if(abs(currentTime.toSec() - prevTime.toSec()) > 1){
-        _prevFeatureCloud = pcl::PointCloud<pcl::PointNormal>();
-        _prevFeatureDescriptor = pcl::PointCloud<pcl::FPFHSignature33>();
-        _prevGroundPlaneCloud = pcl::PointCloud<pcl::PointNormal>();
-    }
-    if (newCloud){
-
-        newCloud=false;
-
-        pcl::PointCloud<pcl::PointXYZ> removedNansCloud;
-        pcl::PointCloud<pcl::PointXYZ> cloud;
-
-        std::vector<int> indices;
-        pcl::removeNaNFromPointCloud(currentCloud, removedNansCloud, indices);
-        if (removedNansCloud.empty())
+void FeatureAssociation::_describeScan(const PointArrayView &scan, ScanBuffers &buffers, ScanFeatures &features)
+{
+    // Everything in here only depends on the scan itself, and runs concurrently for several scans
+    if (!scan.valid())
+        return;
+    pcl::PointCloud<pcl::PointNormal> &cloudWithNormals = buffers.cloudWithNormals;
+    features.leafSize = leafSizeController.leafSize();
+    if (rangeImageNormalsFlag){
+        // The range image needs the finite points at full resolution
+        {
+            PROFILE_STAGE(profiler, "nan_removal");
+            scan.copyFiniteTo(buffers.finiteCloud);
+        }
+        PROFILE_COUNT(profiler, "scan_points", buffers.finiteCloud.size());
+        if (buffers.finiteCloud.empty())
             return;
 
+        // Normals from the full resolution scan grid, then downsampled together with the points
+        _calculateNormalsRangeImage(buffers.finiteCloud, features.leafSize*normalRadiusFactor, buffers, buffers.scanWithNormals);
+        PROFILE_STAGE(profiler, "voxelization");
+        buffers.normalFilter.setLeafSize(features.leafSize);
+        buffers.normalFilter.filter(buffers.scanWithNormals, cloudWithNormals);
+        if (maxPointsPerScan > 0 && cloudWithNormals.size() > (std::size_t) maxPointsPerScan){
+            features.leafSize = leafSizeController.capLeafSize(features.leafSize, cloudWithNormals.size(), maxPointsPerScan);
+            buffers.normalFilter.setLeafSize(features.leafSize);
+            buffers.normalFilter.filter(buffers.scanWithNormals, cloudWithNormals);
+        }
+    }
+    else {
+        // Non-finite points are skipped while binning, straight from the point array
+        PROFILE_STAGE(profiler, "nan_removal_voxelization"); // Fused into one pass in this mode
+        PROFILE_COUNT(profiler, "scan_points", scan.size());
+        buffers.pointFilter.setLeafSize(features.leafSize);
+        buffers.pointFilter.filter(scan, buffers.downsampledCloud);
+        if (maxPointsPerScan > 0 && buffers.downsampledCloud.size() > (std::size_t) maxPointsPerScan){
+            // Bounds the cost of the rest of the scan, the controller catches up on the next ones
+            features.leafSize = leafSizeController.capLeafSize(features.leafSize, buffers.downsampledCloud.size(), maxPointsPerScan);
+            buffers.pointFilter.setLeafSize(features.leafSize);
+            buffers.pointFilter.filter(scan, buffers.downsampledCloud);
+        }
+        if (buffers.downsampledCloud.empty())
+            return;
 
-        pcl::VoxelGrid<pcl::PointXYZ> voxelGridFilter;
-        voxelGridFilter.setInputCloud(removedNansCloud.makeShared());
-        voxelGridFilter.setLeafSize(leafSize, leafSize, leafSize);
-        voxelGridFilter.filter(cloud);
-
-        pcl::PointCloud<pcl::PointNormal> cloudWithNormals;
-        _calculateNormals(cloud, cloudWithNormals);
-
-
-        //std::cout << "INCLOUD\n" << cloud << std::endl;
-
-        pcl::PointCloud<pcl::PointNormal> groundPlane;
-        pcl::PointCloud<pcl::PointNormal> excludedGroundPlane;
-        _findGroundPlane(cloudWithNormals, groundPlane, excludedGroundPlane);
-        //std::cout << "EXCLUDED GROUND PLANE\n" << excludedGroundPlane << std::endl;
-        //std::cout << "GROUND PLANE\n" << groundPlane << std::endl;  
+        // Normals are estimated after the ground is removed, with the shared search tree
+        pcl::copyPointCloud(buffers.downsampledCloud, cloudWithNormals);
 
-        pcl::PointCloud<pcl::PointNormal> featureCloud;
-        pcl::PointCloud<pcl::FPFHSignature33> featureDescriptors;
-        _extractFeatures(excludedGroundPlane, featureCloud, featureDescriptors);
-        //std::cout << "FEATURES CLOUD\n" << featureCloud << std::endl;
-        //std::cout << "FEATURES DESCRIPTORS\n" << featureDescriptors << std::endl;
-        if (featureDescriptors.points.size() < minNrOfFeatures){
+        // The curvature features need the scan rings, which only the range image has
+        if (featureMode == CURVATURE){
+            scan.copyFiniteTo(buffers.finiteCloud);
+            _pointCloud2RangeImage(buffers.finiteCloud, buffers.rangeImage);
+            buffers.validNormal.clear();
+        }
+    }
+    features.nPoints = cloudWithNormals.size();
+    PROFILE_COUNT(profiler, "downsampled_points", features.nPoints);
+
+    FeatureContext context;
+    context.leafSize = features.leafSize;
+    context.normalRadius = features.leafSize*normalRadiusFactor;
+    context.surface = pointPool.acquire();
+    features.groundPlane = pointPool.acquire();
+    Eigen::Vector4f groundCoefficients;
+    bool groundFound = _findGroundPlane(features.seq, cloudWithNormals, *features.groundPlane, *context.surface, groundCoefficients);
+    if (context.surface->empty())
+        return;
+    PROFILE_COUNT(profiler, "surface_points", context.surface->size());
+    PROFILE_COUNT(profiler, "ground_points", features.groundPlane->size());
+
+    // One search tree over the non-ground points for normals, keypoints and descriptors
+    context.tree.reset(new SharedKdTree<pcl::PointNormal>);
+    {
+        PROFILE_STAGE(profiler, "search_tree");
+        context.tree->setInputCloud(context.surface);
+    }
+    if (!rangeImageNormalsFlag)
+        _calculateNormals(context);
+
+    if (featureMode == CURVATURE){
+        // Fixed size feature set for the fast path, descriptors are only computed if it fails
+        features.featureCloud = pointPool.acquire();
+        _extractCurvatureFeatures(buffers, groundFound, groundCoefficients, *features.featureCloud);
+        if (features.featureCloud->size() < minNrOfFeatures)
+            return;
+    }
+    else {
+        if (!_describeKeypoints(context, features.keypoints, features.descriptors, features.descriptorIndex)){
             // Perhaps empty prev
             return;
         }
-        if (_prevFeatureCloud.empty() || _prevFeatureDescriptor.empty() || _prevGroundPlaneCloud.empty()) {
-            std::cout << "INITIALIZING PREVIOUS" << std::endl;
-            _prevFeatureCloud       = featureCloud;
-            _prevFeatureDescriptor  = featureDescriptors;
-            _prevGroundPlaneCloud   = groundPlane;
-            prevTime                = currentTime;
+        features.featureCloud = features.keypoints;
+    }
+    PROFILE_COUNT(profiler, "features", features.featureCloud->size());
+    features.context = context;
+    features.valid = true;
+}
+
+void FeatureAssociation::_matchScan(ScanFeatures &features)
+{
+    // Runs on one thread only, in scan order, as it depends on the previous scan
+    if(std::fabs(features.stamp - prevTime) > 1){
+        _prevFeatureCloud.reset();
+        _prevKeypoints.reset();
+        _prevFeatureDescriptor.reset();
+        _prevGroundPlaneCloud.reset();
+        _prevContext = FeatureContext();
+        _prevDescriptorIndex.reset();
+        motionModelValid = false;
+    }
+    if (!features.valid)
+        return;
+
+    scanTime = features.stamp;
+    double dt = scanTime - prevTime;
+    if (!_prevFeatureCloud || _prevFeatureCloud->empty() || _prevGroundPlaneCloud->empty()) {
+        std::cout << "INITIALIZING PREVIOUS" << std::endl;
+    }
+    else {
+
+        // Try the cheap registration seeded by the motion model first, descriptor matching is the fallback
+        ScanOdometry odometry;
+        bool fastPathSucceeded = false;
+        if (fastPathFlag && motionModelValid && _prevContext.surface){
+            Eigen::Matrix4f T = _predictTransformation(dt).matrix().cast<float>();
+            // Curvature features are a small fixed set already, keypoint mode aligns the subsampled surface
+            const pcl::PointCloud<pcl::PointNormal> &source = featureMode == CURVATURE ? *features.featureCloud : *features.context.surface;
+            if (_fastRegistration(source, T)){
+                transformation = T.cast<double>();
+                fastPathSucceeded = true;
+            }
+        }
+        if (fastPathSucceeded){
+            fastPathHits++;
         }
         else {
+            fastPathMisses++;
+            if (_ensureDescriptors(features)){
+                _calculateTransformation(features.groundPlane, features.keypoints, features.descriptors, features.descriptorIndex);
+            }
+            else {
+                // Too few keypoints to relocalize, coast on the motion model
+                registrationFailures++;
+                odometry.predicted = true;
+                transformation = motionModelValid ? _predictTransformation(dt) : Eigen::Affine3d::Identity();
+            }
+        }
 
-            _calculateTransformation(groundPlane, featureCloud, featureDescriptors);
+        motionModelValid = transformation.matrix().allFinite();
+        lastDt = dt;
 
-            _publish(featureCloud, groundPlane);
+        if (odometryCallback){
+            PROFILE_STAGE(profiler, "publishing");
+            odometry.stamp          = scanTime;
+            odometry.transformation = transformation;
+            odometry.featureCloud   = features.featureCloud;
+            odometry.groundPlane    = features.groundPlane;
+            odometryCallback(odometry);
+        }
 
-            _prevFeatureCloud       = featureCloud;
-            _prevFeatureDescriptor  = featureDescriptors;
-            _prevGroundPlaneCloud   = groundPlane;
-            prevTime                = currentTime;
+    }
+    _prevFeatureCloud       = features.featureCloud;
+    _prevKeypoints          = features.keypoints;
+    _prevFeatureDescriptor  = features.descriptors;
+    _prevGroundPlaneCloud   = features.groundPlane;
+    _prevContext            = features.context;
+    _prevDescriptorIndex    = features.descriptorIndex;
+    prevTime                = scanTime;
+}
+
+Eigen::Affine3d FeatureAssociation::_predictTransformation(double dt) const
+{
+    // Constant velocity: the last scan to scan motion, scaled to the time since the previous scan
+    double ratio = (lastDt > 0 && dt > 0) ? dt / lastDt : 1.0;
+    Eigen::AngleAxisd rotation(transformation.linear());
+    Eigen::Affine3d prediction = Eigen::Affine3d::Identity();
+    prediction.linear() = Eigen::AngleAxisd(rotation.angle()*ratio, rotation.axis()).toRotationMatrix();
+    prediction.translation() = transformation.translation()*ratio;
+    return prediction;
+}
 
+bool FeatureAssociation::_fastRegistration(const pcl::PointCloud<pcl::PointNormal> &source, Eigen::Matrix4f &T)
+{
+    PROFILE_STAGE(profiler, "fast_registration");
+    // Point-to-plane alignment against the non-ground points of the previous scan, using its tree and normals
+    const pcl::PointCloud<pcl::PointNormal> &target = *_prevContext.surface;
+    if (source.empty() || (int) target.size() < minNrOfFeatures)
+        return false;
+
+    int step = std::max(1, (int) source.size() / fastPathMaxPoints);
+    float maxSquaredDistance = fastPathMaxCorrespondenceDistance*fastPathMaxCorrespondenceDistance;
+    Eigen::Matrix4f prediction = T;
+    Eigen::Matrix<double, 6, 1> deviation = Eigen::Matrix<double, 6, 1>::Zero(); // [rotation, translation] from the prediction
+    std::vector<int> index(1);
+    std::vector<float> squaredDistance(1);
+
+    int used = 0, inliers = 0;
+    double squaredResidualSum = 0;
+    for (int iter = 0; ; iter++){
+        Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+        Eigen::Matrix<double, 6, 1> g = Eigen::Matrix<double, 6, 1>::Zero();
+        Eigen::Matrix3f R = T.block<3, 3>(0, 0);
+        Eigen::Vector3f t = T.block<3, 1>(0, 3);
+        used = 0, inliers = 0;
+        squaredResidualSum = 0;
+
+        for (int i = 0; i < (int) source.size(); i += step){
+            used++;
+            pcl::PointNormal p;
+            p.getVector3fMap() = R*source.points[i].getVector3fMap() + t;
+            if (_prevContext.tree->nearestKSearch(p, 1, index, squaredDistance) < 1 || squaredDistance[0] > maxSquaredDistance)
+                continue;
+            const pcl::PointNormal &q = target.points[index[0]];
+            Eigen::Vector3d n = q.getNormalVector3fMap().cast<double>();
+            if (!n.allFinite())
+                continue;
+            Eigen::Vector3d pWorld = p.getVector3fMap().cast<double>();
+            double r = n.dot(pWorld - q.getVector3fMap().cast<double>());
+
+            Eigen::Matrix<double, 6, 1> J;
+            J.head<3>() = pWorld.cross(n);
+            J.tail<3>() = n;
+            H += J*J.transpose();
+            g += J*r;
+            squaredResidualSum += r*r;
+            inliers++;
         }
+        if (inliers < minNrOfFeatures)
+            return false;
+        if (iter == fastPathIterations)
+            break;
+
+        // The prior keeps directions without geometric constraint, like along a straight tunnel, at the prediction
+        double priorWeight = fastPathPriorWeight*inliers;
+        H.diagonal().array() += priorWeight;
+        g += priorWeight*deviation;
+        Eigen::Matrix<double, 6, 1> delta = H.ldlt().solve(-g);
+        deviation += delta;
+
+        Eigen::Vector3d omega = delta.head<3>();
+        Eigen::Matrix4d D = Eigen::Matrix4d::Identity();
+        if (omega.norm() > 0)
+            D.block<3, 3>(0, 0) = Eigen::AngleAxisd(omega.norm(), omega.normalized()).toRotationMatrix();
+        D.block<3, 1>(0, 3) = delta.tail<3>();
+        T = (D*T.cast<double>()).cast<float>();
+
+        if (delta.norm() < 1e-5)
+            break;
     }
+
+    // Quality check, any failure hands the scan to descriptor matching
+    Eigen::Matrix4f correction = prediction.inverse()*T;
+    float correctionAngle = Eigen::AngleAxisf(Eigen::Matrix3f(correction.block<3, 3>(0, 0))).angle();
+    float inlierRatio = (float) inliers / used;
+    float rms = std::sqrt(squaredResidualSum / inliers);
+    return inlierRatio >= fastPathMinInlierRatio
+        && rms <= fastPathMaxRms
+        && correction.block<3, 1>(0, 3).norm() <= fastPathMaxCorrectionTranslation
+        && correctionAngle <= fastPathMaxCorrectionAngle;
 }
\ No newline at end of file
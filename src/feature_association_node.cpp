@@ -1,5 +1,5 @@
 // Node file to create object and initialising the ROS node
-#include "feature_association.hpp"
+#include "feature_association_ros.hpp"
 
 int main(int argc, char** argv)
 {
@@ -10,16 +10,10 @@ int main(int argc, char** argv)
     ros::NodeHandle nh;
     ros::NodeHandle pnh("~"); 
     
-    FeatureAssociation node(nh,pnh); // Creating the object
+    FeatureAssociationRos node(nh,pnh); // Creating the object
 
-    ros::Rate rate(10); // Defing the looping rate
-
-    /* Looking for any interupt else it will continue looping */
-    while (ros::ok())
-    {   
-        ros::spinOnce();
-        node.runOnce();
-        rate.sleep();
-    }
+    /* Scans are processed by the worker threads as soon as the callback has stored them,
+    so the main thread only has to serve callbacks */
+    ros::spin();
     return 0;
 }
\ No newline at end of file
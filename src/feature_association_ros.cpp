@@ -0,0 +1,171 @@
+#include "feature_association_ros.hpp"
+
+#include <pcl_conversions/pcl_conversions.h>
+#include <tf2_eigen/tf2_eigen.h>
+#include <nav_msgs/Odometry.h>
+
+//constructor method
+FeatureAssociationRos::FeatureAssociationRos(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    : featureAssociation(_readParameters(pnh), std::bind(&FeatureAssociationRos::_publish, this, std::placeholders::_1))
+{   
+    nh_ = nh;
+    ROS_INFO("Initializing Feature Association Node");
+
+    // Publishers first, the odometry callback may fire as soon as scans arrive
+    pubGroundPlaneCloud2    = nh.advertise<sensor_msgs::PointCloud2>("/groundPlanePointCloud", 32);
+    pubFeatureCloud2        = nh.advertise<sensor_msgs::PointCloud2>("/featurePointCloud", 32);
+    pubOdometry             = nh.advertise<nav_msgs::Odometry>("/lidarOdom", 32);
+#ifdef TUNNEL_SLAM_PROFILING
+    pnh.param("statistics_period", statisticsPeriod, statisticsPeriod);
+    pubStatistics = nh.advertise<diagnostic_msgs::DiagnosticArray>("/featureAssociation/statistics", 4);
+    statisticsTimer = nh.createWallTimer(ros::WallDuration(statisticsPeriod), &FeatureAssociationRos::_publishStatistics, this);
+#endif
+    subPointCloud2          = nh.subscribe<sensor_msgs::PointCloud2>("/points2", 32, &FeatureAssociationRos::pointCloud2Handler, this);
+}
+
+// Destructor method
+FeatureAssociationRos::~FeatureAssociationRos()
+{
+    subPointCloud2.shutdown();
+    ROS_INFO("Fast path registrations: %lu, descriptor registrations: %lu", (unsigned long) featureAssociation.getFastPathHits(), (unsigned long) featureAssociation.getFastPathMisses());
+}
+
+FeatureAssociationParameters FeatureAssociationRos::_readParameters(ros::NodeHandle &pnh)
+{
+    FeatureAssociationParameters p;
+    pnh.param("workers", p.nrOfWorkers, p.nrOfWorkers);
+    pnh.param("threads_per_stage", p.threadsPerStage, p.threadsPerStage);
+    pnh.param("range_image_normals", p.rangeImageNormalsFlag, p.rangeImageNormalsFlag);
+    pnh.param("range_image_half_window_cols", p.rangeImageHalfWindowCols, p.rangeImageHalfWindowCols);
+    pnh.param("range_image_half_window_rows", p.rangeImageHalfWindowRows, p.rangeImageHalfWindowRows);
+    pnh.param("min_neighbours_normal", p.minNeighboursNormal, p.minNeighboursNormal);
+    pnh.param("fast_path", p.fastPathFlag, p.fastPathFlag);
+    pnh.param("fast_path_iterations", p.fastPathIterations, p.fastPathIterations);
+    pnh.param("fast_path_max_points", p.fastPathMaxPoints, p.fastPathMaxPoints);
+    pnh.param("fast_path_max_correspondence_distance", p.fastPathMaxCorrespondenceDistance, p.fastPathMaxCorrespondenceDistance);
+    pnh.param("fast_path_prior_weight", p.fastPathPriorWeight, p.fastPathPriorWeight);
+    pnh.param("fast_path_min_inlier_ratio", p.fastPathMinInlierRatio, p.fastPathMinInlierRatio);
+    pnh.param("fast_path_max_rms", p.fastPathMaxRms, p.fastPathMaxRms);
+    pnh.param("fast_path_max_correction_translation", p.fastPathMaxCorrectionTranslation, p.fastPathMaxCorrectionTranslation);
+    pnh.param("fast_path_max_correction_angle", p.fastPathMaxCorrectionAngle, p.fastPathMaxCorrectionAngle);
+    pnh.param("approximate_descriptor_search", p.approximateDescriptorSearchFlag, p.approximateDescriptorSearchFlag);
+    pnh.param("descriptor_forest_trees", p.descriptorForestTrees, p.descriptorForestTrees);
+    pnh.param("descriptor_search_checks", p.descriptorSearchChecks, p.descriptorSearchChecks);
+    pnh.param("scan_buffer_size", p.scanBufferSize, p.scanBufferSize);
+    pnh.param("scan_drop_policy", p.scanDropPolicy, p.scanDropPolicy);
+    pnh.param("feature_mode", p.featureModeName, p.featureModeName);
+    pnh.param("curvature_sectors", p.curvatureSectors, p.curvatureSectors);
+    pnh.param("max_edges_per_sector", p.maxEdgesPerSector, p.maxEdgesPerSector);
+    pnh.param("max_planar_per_sector", p.maxPlanarPerSector, p.maxPlanarPerSector);
+    pnh.param("curvature_half_window", p.curvatureHalfWindow, p.curvatureHalfWindow);
+    pnh.param("edge_threshold", p.edgeThreshold, p.edgeThreshold);
+    pnh.param("planar_threshold", p.planarThreshold, p.planarThreshold);
+    pnh.param("curvature_max_range_jump", p.curvatureMaxRangeJump, p.curvatureMaxRangeJump);
+    pnh.param("ground_tracking", p.groundTrackingFlag, p.groundTrackingFlag);
+    pnh.param("ground_distance_threshold", p.groundDistanceThreshold, p.groundDistanceThreshold);
+    pnh.param("leaf_size", p.leafSize, p.leafSize);
+    pnh.param("leaf_size_mode", p.leafSizeMode, p.leafSizeMode);
+    pnh.param("target_points", p.targetPoints, p.targetPoints);
+    pnh.param("time_budget", p.timeBudget, p.timeBudget);
+    pnh.param("min_leaf_size", p.minLeafSize, p.minLeafSize);
+    pnh.param("max_leaf_size", p.maxLeafSize, p.maxLeafSize);
+    pnh.param("max_points_per_scan", p.maxPointsPerScan, p.maxPointsPerScan);
+    return p;
+}
+
+#ifdef TUNNEL_SLAM_PROFILING
+void FeatureAssociationRos::_publishStatistics(const ros::WallTimerEvent &event)
+{
+    std::vector<StageStatus> statuses;
+    featureAssociation.getProfiler().report("feature_association", statuses);
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    for (const auto &stage : statuses){
+        diagnostic_msgs::DiagnosticStatus status;
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.name = stage.name;
+        status.message = stage.message;
+        for (const auto &value : stage.values){
+            diagnostic_msgs::KeyValue keyValue;
+            keyValue.key = value.first;
+            keyValue.value = value.second;
+            status.values.push_back(keyValue);
+        }
+        msg.status.push_back(status);
+    }
+    pubStatistics.publish(msg);
+}
+#endif
+
+void FeatureAssociationRos::pointCloud2Handler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+{   
+    if (!featureAssociation.addScan(pointCloud2View(pointCloud2Msg), pointCloud2Msg->header.stamp.toSec()))
+        ROS_WARN_THROTTLE(1, "Scan buffer full, %lu scans dropped in total", (unsigned long) featureAssociation.getDroppedScans());
+}
+
+void FeatureAssociationRos::_publish(const ScanOdometry &odometry)
+{
+    // Called on the matching thread of the front-end
+    if (odometry.predicted)
+        ROS_WARN_THROTTLE(1, "Registration failed, keeping the predicted motion");
+    _publishFeatureCloud(odometry);
+    _publishTransformation(odometry);
+}
+
+void FeatureAssociationRos::_publishTransformation(const ScanOdometry &odometry)
+{   
+    if (pubOdometry.getNumSubscribers() > 0){
+
+        double delta_x = odometry.transformation.translation().x();
+        double delta_y = odometry.transformation.translation().y();
+        double delta_z = odometry.transformation.translation().z();
+        
+        //Nans
+        if (isnan(delta_x) || isnan(delta_y) || isnan(delta_z))
+            return;
+        
+        // Unstable
+        if (abs(delta_x) > 5 || abs(delta_y) > 5 || abs(delta_z) > 5 || abs(delta_x) + abs(delta_y) > 7)
+            return;
+
+        ros::Time scanTime(odometry.stamp);
+        geometry_msgs::TransformStamped tfMsg   = tf2::eigenToTransform(odometry.transformation);
+        tfMsg.header.stamp                      = scanTime;
+        tfMsg.header.frame_id                   = "odom";
+        tfMsg.child_frame_id                    = "map";
+
+        odomBroadcaster.sendTransform(tfMsg);
+
+        nav_msgs::Odometry odom;
+        odom.header.stamp       = scanTime;
+        odom.header.frame_id    = "odom";
+        
+        odom.pose.pose.position.x   = delta_x;
+        odom.pose.pose.position.y   = delta_y;
+        odom.pose.pose.position.z   = delta_z;
+        odom.pose.pose.orientation  = tfMsg.transform.rotation;
+
+        odom.child_frame_id = "map";
+
+        pubOdometry.publish(odom);
+    }
+
+}
+
+void FeatureAssociationRos::_publishFeatureCloud(const ScanOdometry &odometry)
+{
+    if (pubFeatureCloud2.getNumSubscribers() > 0){
+        sensor_msgs::PointCloud2 msg;
+        pcl::toROSMsg(*odometry.featureCloud, msg);
+        msg.header.stamp = ros::Time(odometry.stamp);
+        msg.header.frame_id = "lidar";
+        pubFeatureCloud2.publish(msg);
+    }
+    if (pubGroundPlaneCloud2.getNumSubscribers() > 0){
+        sensor_msgs::PointCloud2 msg;
+        pcl::toROSMsg(*odometry.groundPlane, msg);
+        msg.header.stamp = ros::Time(odometry.stamp);
+        msg.header.frame_id = "lidar";
+        pubGroundPlaneCloud2.publish(msg);
+    }
+}
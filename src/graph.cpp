@@ -1,20 +1,22 @@
 #include "graph.hpp"
+#include "point_to_map_normal_equations.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <limits>
 
 #include <pcl/common/transforms.h>
 #include <pcl/search/kdtree.h>
-#include <pcl/octree/octree_pointcloud_changedetector.h>
 #include <pcl/registration/correspondence_estimation.h>
 #include <pcl/registration/correspondence_rejection_trimmed.h>
 #include <pcl/registration/correspondence_rejection_var_trimmed.h>
 #include <pcl/registration/correspondence_rejection_sample_consensus.h>
 #include <pcl/registration/icp.h>
 
-
-#include <geometry_msgs/Quaternion.h>
-#include <geometry_msgs/PoseArray.h>
-#include <geometry_msgs/PoseWithCovarianceStamped.h>
-#include <tf/transform_datatypes.h>
-
 #include <gtsam/inference/Symbol.h>
 #include <gtsam/geometry/Rot3.h>
 #include <gtsam/slam/PriorFactor.h>
@@ -25,10 +27,6 @@
 #include <gtsam/slam/SmartProjectionPoseFactor.h>
 #include <gtsam/navigation/GPSFactor.h>
 
-#include <opencv2/core/mat.hpp>
-#include <opencv2/opencv.hpp>
-#include <opencv2/core/eigen.hpp>
-
 using gtsam::symbol_shorthand::B;  // Bias  (ax,ay,az,gx,gy,gz)
 using gtsam::symbol_shorthand::V;  // Vel   (xdot,ydot,zdot)
 using gtsam::symbol_shorthand::X;  // Pose3 (x,y,z,r,p,y)
@@ -36,18 +34,6 @@ using gtsam::symbol_shorthand::L;  // Point3 (x,y,z)
 
 typedef gtsam::BearingRange<gtsam::Pose3, gtsam::Point3> BearingRange3D;
 
-void matrix_square_root( const cv::Mat& A, cv::Mat& sqrtA ) {
-    cv::Mat U, V, Vi, E;
-    cv::eigen( A, E, U );
-    V = U.t();
-    cv::transpose( V, Vi ); // inverse of the orthogonal V
-    cv::sqrt(E, E);         // assume that A is positively
-                            // defined, otherwise its
-                            // square root will be
-                            // complex-valued
-    sqrtA = V * cv::Mat::diag(E) * Vi;
-}
-
 boost::shared_ptr<gtsam::PreintegratedCombinedMeasurements::Params> imuParams() {
   // We use the sensor specs to build the noise model for the IMU factor.
   double accel_noise_sigma = 0.01;//0.0003924;
@@ -86,32 +72,52 @@ boost::shared_ptr<gtsam::PreintegratedCombinedMeasurements::Params> imuParams()
 }
 
 
+bool setGraphParameter(GraphParameters &parameters, const std::string &argument)
+{
+    std::size_t split = argument.find('=');
+    if (split == std::string::npos)
+        return false;
+    const std::string key = argument.substr(0, split), value = argument.substr(split + 1);
+    std::map<std::string, bool*> flags = {
+        {"fixed_lag", &parameters.fixedLagEnabledFlag}, {"keyframe_factors", &parameters.keyFrameFactorsEnabledFlag}};
+    auto flag = flags.find(key);
+    if (flag != flags.end()){
+        if (value != "true" && value != "false" && value != "1" && value != "0")
+            return false;
+        *flag->second = value == "true" || value == "1";
+        return true;
+    }
+    std::istringstream stream(value);
+    std::map<std::string, int*> integers = {
+        {"keyframe_factor_neighbours", &parameters.keyFrameFactorNeighbours}, {"keyframe_alignment_iterations", &parameters.keyFrameAlignmentIterations},
+        {"keyframe_isam_iterations", &parameters.keyFrameIsamIterations}, {"refine_isam_iterations", &parameters.refineIsamIterations},
+        {"loop_closure_isam_iterations", &parameters.loopClosureIsamIterations}};
+    auto integer = integers.find(key);
+    if (integer != integers.end())
+        return (bool) (stream >> *integer->second);
+    std::map<std::string, double*> numbers = {
+        {"fixed_lag_keyframes", &parameters.fixedLagKeyFrames}, {"structure_variance", &parameters.structureVariance},
+        {"keyframe_fitness_score", &parameters.keyFrameFitnessScore}, {"keyframe_min_information", &parameters.keyFrameMinInformation}};
+    auto number = numbers.find(key);
+    if (number == numbers.end())
+        return false;
+    return (bool) (stream >> *number->second);
+}
+
 //constructor method
-Graph::Graph(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+Graph::Graph(const GraphParameters &graphParameters, GraphOutput *output) : GraphParameters(graphParameters), output(output)
 {   
-    nh_ = nh;
-    ROS_INFO("Initializing Graph Node");
-
-    //Subscribers and publishers
-    subOdometry = nh.subscribe<nav_msgs::Odometry>("/lidarOdom", 32, &Graph::odometryHandler, this);
-    subMap = nh.subscribe<sensor_msgs::PointCloud2>("/featurePointCloud", 32, &Graph::mapHandler, this);
-    subGroundPlane = nh.subscribe<sensor_msgs::PointCloud2>("/groundPlanePointCloud", 32, &Graph::groundPlaneHandler, this);
-    subImu = nh.subscribe<sensor_msgs::Imu>("/imu", 32, &Graph::imuHandler, this);
-    subGnss = nh.subscribe<geometry_msgs::PoseStamped>("/gnss", 32, &Graph::gnssHandler, this);
-    pubTransformedMap = nh.advertise<sensor_msgs::PointCloud2>("/map", 1);
-    pubTransformedPose = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/pose", 1);
-    pubPoseArray = nh.advertise<geometry_msgs::PoseArray>("/poseArray", 1);
-    pubReworkedMap = nh.advertise<sensor_msgs::PointCloud2>("/reworkedMap", 1);
-    pubCurrentCloudInWorld = nh.advertise<sensor_msgs::PointCloud2>("/currentFeatureCloudInWorld", 1);
-    pubPotentialLoopCloud = nh.advertise<sensor_msgs::PointCloud2>("/potentialLoopCloud", 1);
-    pubLatestKeyFrameCloud = nh.advertise<sensor_msgs::PointCloud2>("/latestKeyFrameCloud", 1);
-    pubICPResultCloud = nh.advertise<sensor_msgs::PointCloud2>("/icpResultCloud", 1);
-    
+    std::cout << "Initializing Graph" << std::endl;
+
     //Initializing and allocation of memory
     gtsam::ISAM2Params parameters;
     parameters.relinearizeThreshold = 0.01;
     parameters.relinearizeSkip      = 1;
-    isam = new gtsam::ISAM2(parameters);
+    parameters.enableDetailedResults = true; // Tells which variables an update changed
+    if (fixedLagEnabledFlag)
+        fixedLagIsam = new FixedLagIsam(fixedLagKeyFrames, parameters);
+    else
+        isam = new gtsam::ISAM2(parameters);
 
 
     gtsam::Vector6 priorSigmas(6);
@@ -133,21 +139,20 @@ Graph::Graph(ros::NodeHandle &nh, ros::NodeHandle &pnh)
     gtsam::Vector3 gnssSigmas(3);
     gnssSigmas << 1.5, 1.5, 0.05;*/
 
-    downSizeFilterMap.setLeafSize(voxelRes, voxelRes, voxelRes);
+    downSizeFilterMap.setLeafSize(voxelRes);
 
     cloudKeyPositions.reset(new pcl::PointCloud<pcl::PointXYZ>());
     currentFeatureCloud.reset(new pcl::PointCloud<pointT>());
-    currentGroundPlaneCloud.reset(new pcl::PointCloud<pointT>());
     cloudKeyPoses.reset(new pcl::PointCloud<PointXYZRPY>());
     localKeyFramesMap.reset(new pcl::PointCloud<pointT>());
     cloudMapFull.reset(new pcl::PointCloud<pointT>());
     latestKeyFrameCloud.reset(new pcl::PointCloud<pointT>());
     nearHistoryKeyFrameCloud.reset(new pcl::PointCloud<pointT>());
     cloudMapRefined.reset(new pcl::PointCloud<pointT>());
+    localMapIndex.setCellSize(maxCorrespondenceDistance);
 
-
-    octreeMap.reset(new pcl::octree::OctreePointCloudSearch<pointT>(voxelRes));
-    octreeMap->setInputCloud(cloudMapFull);
+    // Sized for the refinement search, the largest one on the full map
+    fullMapIndex.setCellSize(refineMatchDistance);
     kdtreeHistoryKeyPositions.reset(new pcl::KdTreeFLANN<pointT>());
 
     priorNoise = gtsam::noiseModel::Diagonal::Variances(priorSigmas);
@@ -179,12 +184,17 @@ Graph::Graph(ros::NodeHandle &nh, ros::NodeHandle &pnh)
     updateImu = false;
     imuComparisonTimerPtr = &timeOdometry;
 
-    if (gnssEnabledFlag) ROS_INFO("GNSS Enabled");
+    if (gnssEnabledFlag) std::cout << "GNSS Enabled" << std::endl;
+    covarianceThread = std::thread(&Graph::_runCovariances, this);
 }
 // Destructor method
 Graph::~Graph()
 {
-
+    stop();
+    if (covarianceThread.joinable())
+        covarianceThread.join();
+    delete isam;
+    delete fixedLagIsam;
 }
 
 void Graph::_transformToGlobalMap()
@@ -194,18 +204,8 @@ void Graph::_transformToGlobalMap()
 
     pcl::transformPointCloud(*currentFeatureCloud, currentInWorld, currentPoseInWorld.matrix());
     
-    std::vector<int> newPointIdxVector;
-    pcl::octree::OctreePointCloudChangeDetector<pointT> changeDetector(voxelRes);
-    changeDetector.setInputCloud(cloudMapFull);
-    changeDetector.addPointsFromInputCloud();
-    changeDetector.switchBuffers();
-    changeDetector.setInputCloud(currentInWorld.makeShared());
-    changeDetector.addPointsFromInputCloud();
-    changeDetector.getPointIndicesFromNewVoxels(newPointIdxVector);
-
-    for (std::size_t i = 0; i<newPointIdxVector.size(); ++i){
-        octreeMap->addPointToCloud(currentInWorld[newPointIdxVector[i]],cloudMapFull);
-    }
+    // Points that are not within a voxel of the map
+    _addToFullMap(currentInWorld, voxelRes);
 }
 
 void Graph::_incrementPosition()
@@ -217,7 +217,7 @@ void Graph::_incrementPosition()
 }
 
 void Graph::_initializePreintegration(){
-    ROS_INFO("IMU Enabled - Initializing");
+    std::cout << "IMU Enabled - Initializing" << std::endl;
     gtsam::Vector3 priorVelocity = gtsam::Vector3::Zero();
     gtsam::imuBias::ConstantBias priorBias; //Assumed 0 initial bias
     _graph.add(gtsam::PriorFactor<gtsam::Vector3>(V(0), priorVelocity, imuVelocityNoise));
@@ -274,41 +274,24 @@ void Graph::_performIsam()
         _graph.add(gtsam::GPSFactor(X(index), gnssMeasurement.second, gnssNoise));
     }
 
-    PointXYZRPY currentPose;
-    isam->update(_graph, initialEstimate);
-    isam->update();
+    _updateIsam(_graph, initialEstimate, keyFrameIsamIterations);
 
     _graph.resize(0);
     initialEstimate.clear();
 
-    isamCurrentEstimate = isam->calculateEstimate();
-
     if (updateImu){
-        prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), isamCurrentEstimate.at<gtsam::Vector3>(V(index)));
-        prevImuBias = isamCurrentEstimate.at<gtsam::imuBias::ConstantBias>(B(index));
+        prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), _isam().calculateEstimate<gtsam::Vector3>(V(index)));
+        prevImuBias = _isam().calculateEstimate<gtsam::imuBias::ConstantBias>(B(index));
         preintegrated->resetIntegrationAndSetBias(prevImuBias);
         updateImu=false;
     }
 
     currentPoseInWorld = isamCurrentEstimate.at<gtsam::Pose3>(X(index));
-    int numPoses = cloudKeyPositions->size() + 1;
-    cloudKeyPositions->clear();
-    cloudKeyPoses->clear();
-    for (int i = 0; i < numPoses; i++){
-        gtsam::Pose3 pose;
-        pose = isamCurrentEstimate.at<gtsam::Pose3>(X(i+1));
-        cloudKeyPositions->push_back(pcl::PointXYZ(pose.x(), pose.y(), pose.z()));
-        
-        _fromPose3ToPointXYZRPY(pose, currentPose);
-
-        cloudKeyPoses->push_back(currentPose);
-    }
     timeKeyPosePairs.push_back(std::pair<double, gtsam::Pose3>(timeOdometry, currentPoseInWorld));
 
     lastPoseInWorld = currentPoseInWorld;
     pcl::PointCloud<pointT>::Ptr thisKeyFrame(new pcl::PointCloud<pointT>());
-    downSizeFilterMap.setInputCloud(currentFeatureCloud);
-    downSizeFilterMap.filter(*thisKeyFrame);
+    downSizeFilterMap.filter(*currentFeatureCloud, *thisKeyFrame);
     cloudKeyFrames.push_back(thisKeyFrame);
     cloudsInQueue += 1;
 }
@@ -322,53 +305,82 @@ void Graph::_mapToGraph(){
     int startIdx = cloudKeyFrames.size() - cloudsInQueue;
     int cloudsInQueueAtRunTime = cloudsInQueue;
 
-    std::vector<gtsam::Pose3> framePoses;
-    for (int i = startIdx; i<startIdx + cloudsInQueueAtRunTime; i++)
+    // Only the poses and the keyframes, which do not change once stored, are taken under mtx
+    struct MapMatches
     {
-        framePoses.push_back(isamCurrentEstimate.at<gtsam::Pose3>(X(i+1)));
+        gtsam::Pose3 pose;
+        pcl::PointCloud<pointT>::ConstPtr keyFrame;
+        pcl::PointCloud<pointT>::Ptr cloudInWorld;
+        pcl::PointCloud<pointT>::Ptr mapPoints; // Matched points of the full map
+        std::vector<int> mapIndices; // Of mapPoints in cloudMapFull
+        pcl::CorrespondencesPtr correspondences; // Query in cloudInWorld, match in mapPoints
+    };
+    std::vector<MapMatches> matches(cloudsInQueueAtRunTime);
+    for (int i = 0; i < cloudsInQueueAtRunTime; i++){
+        matches[i].pose = isamCurrentEstimate.at<gtsam::Pose3>(X(startIdx+i+1));
+        matches[i].keyFrame = cloudKeyFrames.at(startIdx+i);
     }
-    pcl::registration::CorrespondenceEstimation<pointT, pointT> matcher;
-    matcher.setInputTarget(cloudMapFull);
-    pcl::registration::CorrespondenceRejectorSampleConsensus<pointT> trimmer;
-    trimmer.setInputTarget(cloudMapFull);
-    pcl::KdTreeFLANN<pointT> kdTree;
-    kdTree.setInputCloud(cloudMapRefined);
-    std::vector<int> indices;
-    std::vector<float> distances;
-    //pcl::registration::CorrespondenceRejectorTrimmed trimmer;
     mtx.unlock();
 
+    // Correspondences come from the persistent index of the full map. Only runOnce adds to it, under
+    // mapMtx, which is held for one keyframe at a time.
+    for (MapMatches &cloudMatches : matches){
+        cloudMatches.cloudInWorld.reset(new pcl::PointCloud<pointT>());
+        cloudMatches.mapPoints.reset(new pcl::PointCloud<pointT>());
+        cloudMatches.correspondences.reset(new pcl::Correspondences);
+        pcl::transformPointCloud(*cloudMatches.keyFrame, *cloudMatches.cloudInWorld, cloudMatches.pose.matrix());
+        std::unordered_map<int, int> compactIndex; // Point of cloudMapFull to its correspondence
+        std::lock_guard<std::mutex> lock(mapMtx);
+        for (std::size_t j = 0; j < cloudMatches.cloudInWorld->size(); j++){
+            float squaredDistance;
+            int match = fullMapIndex.nearest(cloudMatches.cloudInWorld->points[j].getVector3fMap(), refineMatchDistance, &squaredDistance);
+            if (match < 0)
+                continue;
+            // Reciprocal among the matches, a map point keeps the closest scan point that chose it
+            auto inserted = compactIndex.insert(std::make_pair(match, (int) cloudMatches.correspondences->size()));
+            if (inserted.second){
+                cloudMatches.correspondences->push_back(pcl::Correspondence(j, cloudMatches.mapPoints->size(), squaredDistance));
+                cloudMatches.mapPoints->push_back(cloudMapFull->points[match]);
+                cloudMatches.mapIndices.push_back(match);
+            }
+            else if (squaredDistance < cloudMatches.correspondences->at(inserted.first->second).distance){
+                cloudMatches.correspondences->at(inserted.first->second).index_query = j;
+                cloudMatches.correspondences->at(inserted.first->second).distance = squaredDistance;
+            }
+        }
+    }
+
+    pcl::registration::CorrespondenceRejectorSampleConsensus<pointT> trimmer;
+    //pcl::registration::CorrespondenceRejectorTrimmed trimmer;
     //trimmer.setOverlapRatio(0.4);
     trimmer.setMaximumIterations(500);
     trimmer.setRefineModel(true);
 
     gtsam::ExpressionFactorGraph graph;
-    gtsam::Values initial;
+    gtsam::Values observed; // First measurement of every landmark, the initial value if it is new
+    std::vector<std::pair<gtsam::Key, int> > observedMapKeys;
     for (int cloudnr = startIdx; cloudnr < startIdx + cloudsInQueueAtRunTime; cloudnr++){
-        gtsam::Pose3 pose = framePoses[cloudnr-startIdx];
-        pcl::PointCloud<pointT> cloudInWorld;
-        pcl::PointCloud<pointT> cloud = *cloudKeyFrames.at(cloudnr);
-        
-        pcl::transformPointCloud(cloud, cloudInWorld, pose.matrix());
-
-        pcl::CorrespondencesPtr allCorrespondences(new pcl::Correspondences);
-        matcher.setInputSource(cloudInWorld.makeShared());
-        matcher.determineReciprocalCorrespondences(*allCorrespondences, 2); 
+        MapMatches &cloudMatches = matches[cloudnr-startIdx];
+        const gtsam::Pose3 &pose = cloudMatches.pose;
+        const pcl::PointCloud<pointT> &cloudInWorld = *cloudMatches.cloudInWorld;
         if (cloudInWorld.points.size() < 50)
             continue;
+
         pcl::CorrespondencesPtr trimmedCorrespondences(new pcl::Correspondences);
-        trimmer.setInputSource(cloudInWorld.makeShared());
-        trimmer.setInputCorrespondences(allCorrespondences);
+        trimmer.setInputSource(cloudMatches.cloudInWorld);
+        trimmer.setInputTarget(cloudMatches.mapPoints);
+        trimmer.setInputCorrespondences(cloudMatches.correspondences);
         
         trimmer.getCorrespondences(*trimmedCorrespondences);
         if (trimmedCorrespondences->size() < minCorresponendencesStructure) continue;
         std::cout << "MAP CORRESPONDENCES: " << trimmedCorrespondences->size() << std::endl;
-        pcl::PointCloud<pointT>::Ptr currentMap(new pcl::PointCloud<pointT>(*cloudMapFull));
+        // Landmarks are kept refinedMapMinDistance apart, measured in the full map
+        std::lock_guard<std::mutex> lock(mapMtx);
         for (int j = 0; j<trimmedCorrespondences->size(); j++){
 
-            int pointIdx = trimmedCorrespondences->at(j).index_match;
-            pointT pclPoint = cloudMapFull->at(pointIdx);
-            if (!cloudMapRefined->empty() && kdTree.radiusSearch(pclPoint, 1, indices, distances) > 0){
+            int pointIdx = cloudMatches.mapIndices[trimmedCorrespondences->at(j).index_match];
+            pointT pclPoint = cloudMatches.mapPoints->points[trimmedCorrespondences->at(j).index_match];
+            if (fullMapIndex.anyWithin(pclPoint.getVector3fMap(), refinedMapMinDistance, [this](int id){ return isLandmark[id] != 0; })){
                 continue;
             }
             gtsam::Point3 pointWorld = gtsam::Point3(pclPoint.x, pclPoint.y, pclPoint.y);
@@ -381,9 +393,9 @@ void Graph::_mapToGraph(){
             auto measurement = BearingRange3D(pose.bearing(pointMeasured), pose.range(pointMeasured));
 
             graph.addExpressionFactor(prediction, measurement, structureNoise);
-            if (!isamCurrentEstimate.exists(L(pointIdx)) && !initial.exists(L(pointIdx))) {
-                initial.insert(L(pointIdx), pointMeasured);
-                mapKeys.push_back(std::make_pair(L(pointIdx), pointIdx));
+            if (!observed.exists(L(pointIdx))) {
+                observed.insert(L(pointIdx), pointMeasured);
+                observedMapKeys.push_back(std::make_pair(L(pointIdx), pointIdx));
             }
             /*if (!smoothMapEstimate.exists(L(pointIdx))){
                 initial.insert(L(pointIdx), pointMeasured);
@@ -402,9 +414,26 @@ void Graph::_mapToGraph(){
     smoothMapEstimate = isamMap->calculateEstimate();*/
     mtx.lock();
     cloudsInQueue = 0;
-    isam->update(graph, initial);
-    isam->update();
-    isamCurrentEstimate = isam->calculateEstimate();
+    // Which landmarks are new is only known under the lock, runOnce updates the same ISAM2. Frozen ones
+    // stay frozen, their factors are dropped by _updateFixedLag.
+    gtsam::Values initial;
+    std::vector<std::pair<gtsam::Key, int> > newMapKeys;
+    for (const auto &key : observedMapKeys){
+        if (_isam().valueExists(key.first) || _frozen(key.first))
+            continue;
+        initial.insert(key.first, observed.at(key.first));
+        newMapKeys.push_back(key);
+    }
+    _updateIsam(graph, initial, refineIsamIterations);
+    // In the fixed-lag mode landmarks of keyframes that left the window meanwhile were not added
+    mapMtx.lock();
+    for (const auto &key : newMapKeys){
+        if (!_isam().valueExists(key.first))
+            continue;
+        mapKeys.push_back(key);
+        isLandmark[key.second] = 1;
+    }
+    mapMtx.unlock();
     /*for (auto key : mapKeys){
         gtsam::Point3 point = isamCurrentEstimate.at<gtsam::Point3>(key.first);
         pointT pclpoint;
@@ -417,24 +446,201 @@ void Graph::_mapToGraph(){
     //_publishReworkedMap(keys);
 }
 
+void Graph::_keyFramesToGraph()
+{
+    // Each new keyframe is aligned to the closest earlier ones, apart from its predecessor which odometry already ties it to
+    struct KeyFramePair
+    {
+        int from, to;
+        gtsam::Pose3 relative; // Of to in from, as estimated now
+        pcl::PointCloud<pointT>::ConstPtr source, target;
+    };
+    std::vector<KeyFramePair> pairs;
+    mtx.lock();
+    int endIdx = std::min(cloudKeyFrames.size(), cloudKeyPositions->size());
+    int startIdx = std::max(0, (int) cloudKeyFrames.size() - cloudsInQueue);
+    cloudsInQueue = 0;
+    const float squaredRadius = localMapRadius*localMapRadius;
+    for (int k = startIdx; k < endIdx; k++){
+        if (cloudKeyFrames[k]->empty())
+            continue;
+        std::vector<std::pair<float, int> > candidates;
+        for (int j = 0; j + 1 < k; j++){
+            float squaredDistance = (cloudKeyPositions->points[j].getVector3fMap() - cloudKeyPositions->points[k].getVector3fMap()).squaredNorm();
+            if (squaredDistance <= squaredRadius && !cloudKeyFrames[j]->empty())
+                candidates.push_back(std::make_pair(squaredDistance, j));
+        }
+        if ((int) candidates.size() > keyFrameFactorNeighbours){
+            std::nth_element(candidates.begin(), candidates.begin() + keyFrameFactorNeighbours, candidates.end());
+            candidates.resize(keyFrameFactorNeighbours);
+        }
+        for (const auto &candidate : candidates){
+            KeyFramePair pair;
+            pair.from = candidate.second;
+            pair.to = k;
+            pair.relative = isamCurrentEstimate.at<gtsam::Pose3>(X(pair.from+1)).between(isamCurrentEstimate.at<gtsam::Pose3>(X(pair.to+1)));
+            pair.source = cloudKeyFrames[k];
+            pair.target = cloudKeyFrames[pair.from];
+            pairs.push_back(pair);
+        }
+    }
+    mtx.unlock();
+    if (pairs.empty())
+        return;
+
+    // The correspondences of a pair are compressed into a single between factor, so the graph grows with keyframes
+    gtsam::NonlinearFactorGraph graph;
+    for (KeyFramePair &pair : pairs){
+        gtsam::Matrix information;
+        if (!_alignKeyFrames(*pair.source, *pair.target, pair.relative, information))
+            continue;
+        graph.add(gtsam::BetweenFactor<gtsam::Pose3>(X(pair.from+1), X(pair.to+1), pair.relative, gtsam::noiseModel::Gaussian::Information(information)));
+    }
+    if (graph.empty())
+        return;
+    mtx.lock();
+    _updateIsam(graph, gtsam::Values(), refineIsamIterations);
+    mtx.unlock();
+}
+
+bool Graph::_alignKeyFrames(const pcl::PointCloud<pointT> &source, const pcl::PointCloud<pointT> &target, gtsam::Pose3 &relative, gtsam::Matrix &information)
+{
+    // Gauss-Newton on point-to-point distances of source in the frame of target, starting from the estimated relative pose
+    VoxelMapIndex targetIndex(maxCorrespondenceDistance);
+    for (std::size_t i = 0; i < target.size(); i++){
+        targetIndex.insert(i, target.points[i].getVector3fMap());
+    }
+    PointToMapNormalEquations equations;
+    equations.reserve(source.size());
+    PointToMapNormalEquations::Matrix6 H;
+    PointToMapNormalEquations::Vector6 g;
+    Eigen::SelfAdjointEigenSolver<PointToMapNormalEquations::Matrix6> eigen;
+    for (int iteration = 0; iteration <= keyFrameAlignmentIterations; iteration++){
+        const Eigen::Matrix3d R = relative.rotation().matrix();
+        const Eigen::Vector3d t(relative.x(), relative.y(), relative.z());
+        equations.clear();
+        for (const auto &point : source.points){
+            const Eigen::Vector3d local = point.getVector3fMap().cast<double>();
+            int match = targetIndex.nearest((R*local + t).cast<float>(), maxCorrespondenceDistance);
+            if (match >= 0)
+                equations.add(local, target.points[match].getVector3fMap().cast<double>());
+        }
+        if (equations.size() < minCorresponendencesStructure)
+            return false;
+        equations.linearize(R, t, structureVariance, H, g);
+        eigen.compute(H);
+        if (iteration == keyFrameAlignmentIterations)
+            break;
+
+        // Only along the observed directions, a straight tunnel leaves the translation along it free
+        PointToMapNormalEquations::Vector6 step = PointToMapNormalEquations::Vector6::Zero();
+        for (int i = 0; i < 6; i++){
+            if (eigen.eigenvalues()(i) > keyFrameMinInformation)
+                step += eigen.eigenvectors().col(i)*eigen.eigenvectors().col(i).dot(g) / eigen.eigenvalues()(i);
+        }
+        relative = relative.retract(step);
+        if (step.norm() < 1e-4)
+            break;
+    }
+    const Eigen::Matrix3d R = relative.rotation().matrix();
+    if (equations.cost(R, Eigen::Vector3d(relative.x(), relative.y(), relative.z())) / equations.size() > keyFrameFitnessScore)
+        return false;
+    information = eigen.eigenvectors()*eigen.eigenvalues().cwiseMax(keyFrameMinInformation).asDiagonal()*eigen.eigenvectors().transpose();
+    return true;
+}
+
 void Graph::runLoopClosure()
 {
     if (!loopClosureEnabledFlag)
         return;
-    ros::Rate rate(0.25);
-    ros::Duration sleepTime(10);
-    ROS_INFO("Loop Closure Thread Running");
-    while (ros::ok()){
+    std::cout << "Loop Closure Thread Running" << std::endl;
+    bool sleeping = true;
+    while (sleeping){
         if (_performLoopClosure()){
-            ROS_INFO("LOOP CLOSURE REGISTERED, GOOD NIGHT");
-            sleepTime.sleep();
+            std::cout << "LOOP CLOSURE REGISTERED, GOOD NIGHT" << std::endl;
+            sleeping = _sleepFor(10);
         }
         else{
-            rate.sleep();
+            sleeping = _sleepFor(4);
+        }
+    }
+}
+
+void Graph::stop()
+{
+    runningMtx.lock();
+    running = false;
+    runningMtx.unlock();
+    stopRequested.notify_all();
+    covarianceMtx.lock();
+    covarianceStopped = true;
+    covarianceMtx.unlock();
+    covarianceRequested.notify_all();
+}
+
+void Graph::_publishPose(double stamp, const gtsam::Pose3 &pose, gtsam::Key key)
+{
+    // Published at once with the newest covariance known, the one of this pose is recovered in the background
+    auto cached = covarianceCache.find(key);
+    output->publishPose(stamp, pose, cached != covarianceCache.end() ? cached->second.second : latestCovariance);
+    covarianceMtx.lock();
+    covarianceRequests.push_back(key);
+    covarianceMtx.unlock();
+    covarianceRequested.notify_one();
+}
+
+void Graph::_runCovariances()
+{
+    while (true){
+        gtsam::Key key;
+        {
+            std::unique_lock<std::mutex> lock(covarianceMtx);
+            covarianceRequested.wait(lock, [this]{ return covarianceStopped || !covarianceRequests.empty(); });
+            if (covarianceStopped)
+                return;
+            // Only the newest pose is still going to be published with it
+            key = covarianceRequests.back();
+            covarianceRequests.clear();
         }
+        // One key per lock, so runOnce waits for at most one recovery
+        std::lock_guard<std::mutex> lock(mtx);
+        latestCovariance = _marginalCovariance(key);
+    }
+}
+
+const gtsam::Matrix &Graph::_marginalCovariance(gtsam::Key key)
+{
+    auto cached = covarianceCache.find(key);
+    if (cached != covarianceCache.end() && (cached->second.first == isamVersion || _frozen(key)))
+        return cached->second.second;
+    std::pair<uint64_t, gtsam::Matrix> &entry = covarianceCache[key];
+    if (_frozen(key)) // Marginalized before anyone asked, unknown
+        entry = std::make_pair(isamVersion, gtsam::Matrix::Constant(6, 6, std::numeric_limits<double>::quiet_NaN()));
+    else
+        entry = std::make_pair(isamVersion, _isam().marginalCovariance(key));
+    return entry.second;
+}
+
+void Graph::_jointCovariances(const gtsam::KeyVector &keys, std::vector<gtsam::Matrix> &covariances)
+{
+    // The graph is eliminated once in Marginals, every key is then read from that Bayes tree.
+    // Linearized at the current estimate, the caller refreshes it first.
+    gtsam::Marginals marginals(_isam().getFactorsUnsafe(), _currentEstimate());
+    covariances.resize(keys.size());
+    for (std::size_t i = 0; i < keys.size(); i++){
+        covariances[i] = marginals.marginalCovariance(keys[i]);
+        covarianceCache[keys[i]] = std::make_pair(isamVersion, covariances[i]);
     }
 }
 
+bool Graph::_sleepFor(double seconds)
+{
+    // Woken early by stop
+    std::unique_lock<std::mutex> lock(runningMtx);
+    stopRequested.wait_for(lock, std::chrono::duration<double>(seconds), [this]{ return !running; });
+    return running;
+}
+
 bool Graph::_detectLoopClosure()
 {   
     latestKeyFrameCloud->clear();
@@ -509,16 +715,12 @@ bool Graph::_performLoopClosure()
     icp.setInputTarget(nearHistoryKeyFrameCloud);
     pcl::PointCloud<pointT>::Ptr unused_result(new pcl::PointCloud<pointT>());
     icp.align(*unused_result);
-    sensor_msgs::PointCloud2 msg;
-    pcl::toROSMsg(*unused_result, msg);
-    msg.header.frame_id = "map";
-    pubICPResultCloud.publish(msg);
-    pcl::toROSMsg(*nearHistoryKeyFrameCloud, msg);
-    msg.header.frame_id = "map";
-    pubPotentialLoopCloud.publish(msg);
-    pcl::toROSMsg(*latestKeyFrameCloud, msg);
-    msg.header.frame_id = "map";
-    pubLatestKeyFrameCloud.publish(msg);
+    if (_wants(GraphOutput::ICP_RESULT_CLOUD))
+        output->publishCloud(GraphOutput::ICP_RESULT_CLOUD, *unused_result);
+    if (_wants(GraphOutput::POTENTIAL_LOOP_CLOUD))
+        output->publishCloud(GraphOutput::POTENTIAL_LOOP_CLOUD, *nearHistoryKeyFrameCloud);
+    if (_wants(GraphOutput::LATEST_KEY_FRAME_CLOUD))
+        output->publishCloud(GraphOutput::LATEST_KEY_FRAME_CLOUD, *latestKeyFrameCloud);
     std::cout << "ICP FITNESS SCORE: " << icp.getFitnessScore() << std::endl;
 
     if (icp.hasConverged() == false || icp.getFitnessScore() > historyKeyframeFitnessScore)
@@ -545,10 +747,15 @@ bool Graph::_performLoopClosure()
     // add to isam graph
     gtsam::NonlinearFactorGraph graph;
     std::cout << "BETWEEN KEYPOSE #: " << latestFrameIDLoopClosure << " AND " << closestHistoryFrameID << std::endl;
-    graph.add(gtsam::BetweenFactor<gtsam::Pose3>(X(latestFrameIDLoopClosure+1), X(closestHistoryFrameID+1), poseFrom.between(poseTo), constraintNoise));
     std::lock_guard<std::mutex> lock(mtx);
-    isam->update(graph);
-    isam->update();
+    if (_frozen(X(closestHistoryFrameID+1))){
+        // The history pose left the fixed-lag window, its frozen estimate anchors the latest pose instead
+        graph.add(gtsam::PriorFactor<gtsam::Pose3>(X(latestFrameIDLoopClosure+1), poseFrom, constraintNoise));
+    }
+    else {
+        graph.add(gtsam::BetweenFactor<gtsam::Pose3>(X(latestFrameIDLoopClosure+1), X(closestHistoryFrameID+1), poseFrom.between(poseTo), constraintNoise));
+    }
+    _updateIsam(graph, gtsam::Values(), loopClosureIsamIterations);
     aLoopIsClosed = true;
     return true;
     /*PointXYZRPY currentPose;
@@ -569,14 +776,8 @@ bool Graph::_performLoopClosure()
     //aLoopIsClosed = true;*/
 }
 
-void Graph::odometryHandler(const nav_msgs::OdometryConstPtr &odomMsg)
+void Graph::addOdometry(double time, const gtsam::Pose3 &pose)
 {
-    double time = odomMsg->header.stamp.toSec();
-
-    gtsam::Point3 pos(odomMsg->pose.pose.position.x, odomMsg->pose.pose.position.y, odomMsg->pose.pose.position.z);
-    gtsam::Rot3 rot = gtsam::Rot3::Quaternion(odomMsg->pose.pose.orientation.w, odomMsg->pose.pose.orientation.x, odomMsg->pose.pose.orientation.y, odomMsg->pose.pose.orientation.z);
-    gtsam::Pose3 pose(rot, pos);
-
     mtx.lock();
     odometryMeasurements.push_back(std::pair<double, gtsam::Pose3>(time, pose));
     timeOdometry = time;
@@ -588,206 +789,381 @@ void Graph::odometryHandler(const nav_msgs::OdometryConstPtr &odomMsg)
     mtx.unlock();
 }
 
-void Graph::mapHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+void Graph::addFeatureCloud(double time, const PointArrayView &cloud)
 {   
-    pcl::PointCloud<pointT> tmp;
-    pcl::fromROSMsg(*pointCloud2Msg, tmp);
+    // Only the view is kept, it is copied into currentFeatureCloud once it is processed
     mtx.lock();
-    timeMap = pointCloud2Msg->header.stamp.toSec();
-    *currentFeatureCloud = tmp;
+    timeMap = time;
+    currentFeatureView = cloud;
     newMap = true;
     mtx.unlock();
 }
 
-void Graph::groundPlaneHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+void Graph::addGroundPlane(double time, const PointArrayView &cloud)
 {   
-    pcl::PointCloud<pointT> tmp;
-    pcl::fromROSMsg(*pointCloud2Msg, tmp);
     mtx.lock();
-    *currentGroundPlaneCloud = tmp;
-    timeMap = pointCloud2Msg->header.stamp.toSec();
+    currentGroundPlaneView = cloud;
+    timeMap = time;
     newGroundPlane = true;
     mtx.unlock();
 }
 
-void Graph::imuHandler(const sensor_msgs::ImuConstPtr &imuMsg){
+void Graph::_takeFeatureCloud()
+{
+    if (currentFeatureView.valid())
+        currentFeatureView.copyTo(*currentFeatureCloud);
+    currentFeatureView = PointArrayView();
+}
+
+void Graph::addImu(double time, const gtsam::Vector6 &measurement){
     if (!imuEnabledFlag) return;
-    double time = imuMsg->header.stamp.toSec();
-    gtsam::Vector6 measurement;
-    measurement << imuMsg->linear_acceleration.x, imuMsg->linear_acceleration.y, imuMsg->linear_acceleration.z, imuMsg->angular_velocity.x, imuMsg->angular_velocity.y, imuMsg->angular_velocity.z; //IMU measurement in Lidar frame
-    //measurement << imuMsg->linear_acceleration.x, imuMsg->linear_acceleration.y, imuMsg->linear_acceleration.z, imuMsg->angular_velocity.x, imuMsg->angular_velocity.y, imuMsg->angular_velocity.z;
     mtx.lock();
     imuMeasurements.push_back(std::pair<double, gtsam::Vector6>(time, measurement));
     newImu = true;
     mtx.unlock();
 }
 
-void Graph::gnssHandler(const geometry_msgs::PoseStampedConstPtr &gnssMsg)
+void Graph::addGnss(double time, const gtsam::Point3 &pos)
 {
     if (!gnssEnabledFlag) return;
-    double time = gnssMsg->header.stamp.toSec();
-    gtsam::Point3 pos(gnssMsg->pose.position.x, gnssMsg->pose.position.y, gnssMsg->pose.position.z);
-
     mtx.lock();
     gnssMeasurement = std::pair<double, gtsam::Point3>(time, pos);
     newGnss = true;
     mtx.unlock();
 }
 
-void Graph::_cloud2Map(){
-    auto skewSymmetric = [](double a, double b, double c){return gtsam::skewSymmetric(a, b, c);};
+void Graph::_updateIsam(const gtsam::NonlinearFactorGraph &graph, const gtsam::Values &values, int extraIterations)
+{
+    isamVersion++;
+    if (fixedLagIsam != NULL){
+        _updateFixedLag(graph, values, extraIterations);
+    }
+    else {
+        _recordChangedKeys(isam->update(graph, values));
+        for (int i = 0; i < extraIterations; i++){
+            _recordChangedKeys(isam->update());
+        }
+    }
+
+    _readChangedPoses();
+}
+
+void Graph::_readChangedPoses()
+{
+    // Poses are read back right away for the caches, key pose i is X(i+1)
+    for (gtsam::Key key : changedPoseKeys){
+        gtsam::Pose3 pose = _isam().calculateEstimate<gtsam::Pose3>(key);
+        if (isamCurrentEstimate.exists(key)){
+            if (isamCurrentEstimate.at<gtsam::Pose3>(key).equals(pose, 1e-9))
+                continue;
+            isamCurrentEstimate.update(key, pose);
+        }
+        else
+            isamCurrentEstimate.insert(key, pose);
+
+        gtsam::Symbol symbol(key);
+        if (symbol.index() == 0)
+            continue;
+        std::size_t i = symbol.index() - 1;
+        if (i >= cloudKeyPositions->size()){
+            cloudKeyPositions->resize(i + 1);
+            cloudKeyPoses->resize(i + 1);
+            keyPoseVersions.resize(i + 1, 0);
+        }
+        cloudKeyPositions->points[i] = pcl::PointXYZ(pose.x(), pose.y(), pose.z());
+        _fromPose3ToPointXYZRPY(pose, cloudKeyPoses->points[i]);
+        keyPoseVersions[i]++;
+    }
+    changedPoseKeys.clear();
+}
+
+void Graph::_updateFixedLag(const gtsam::NonlinearFactorGraph &graph, const gtsam::Values &values, int extraIterations)
+{
+    // Keyframe indices are the clock, so the window holds the same number of keyframes at any speed
+    for (const auto &value : values){
+        gtsam::Symbol symbol(value.key);
+        if (symbol.chr() == 'x')
+            fixedLagStamp = std::max(fixedLagStamp, (double) symbol.index());
+    }
+
+    // Variables the smoother is about to marginalize are frozen at their last estimate, which keeps the
+    // old trajectory and landmarks in isamCurrentEstimate for the maps
+    const gtsam::ISAM2 &window = fixedLagIsam->isam2();
+    gtsam::KeyVector leaving;
+    for (const auto &stamped : fixedLagIsam->timestamps()){
+        if (stamped.second >= fixedLagStamp - fixedLagKeyFrames)
+            continue;
+        const gtsam::Value &value = window.calculateEstimate(stamped.first);
+        if (isamCurrentEstimate.exists(stamped.first))
+            isamCurrentEstimate.update(stamped.first, value);
+        else
+            isamCurrentEstimate.insert(stamped.first, value);
+        if (gtsam::Symbol(stamped.first).chr() == 'l')
+            movedLandmarkKeys.insert(stamped.first);
+        leaving.push_back(stamped.first);
+    }
+
+    // Factors on variables that already left are dropped, and new variables left without factors with them
+    gtsam::NonlinearFactorGraph newFactors;
+    for (const auto &factor : graph){
+        bool inWindow = factor != NULL;
+        for (std::size_t i = 0; inWindow && i < factor->keys().size(); i++){
+            inWindow = (values.exists(factor->keys()[i]) && !_frozen(factor->keys()[i])) || window.valueExists(factor->keys()[i]);
+        }
+        if (inWindow)
+            newFactors.push_back(factor);
+    }
+    const gtsam::KeySet constrained = newFactors.keys();
+    gtsam::Values newValues;
+    gtsam::FixedLagSmoother::KeyTimestampMap timestamps;
+    for (const auto &value : values){
+        if (constrained.count(value.key) == 0 || window.valueExists(value.key))
+            continue;
+        newValues.insert(value.key, value.value);
+        timestamps[value.key] = fixedLagStamp;
+    }
+
+    fixedLagIsam->update(newFactors, newValues, timestamps);
+    _recordChangedKeys(fixedLagIsam->getISAM2Result());
+    for (int i = 0; i < extraIterations; i++){
+        fixedLagIsam->update();
+        _recordChangedKeys(fixedLagIsam->getISAM2Result());
+    }
+    for (gtsam::Key key : leaving){
+        changedPoseKeys.erase(key);
+        staleKeys.erase(key);
+    }
+}
+
+void Graph::_recordChangedKeys(const gtsam::ISAM2Result &result)
+{
+    if (!result.detail)
+        return;
+    for (const auto &status : result.detail->variableStatus){
+        if (!status.second.isNew && !status.second.isReeliminated && !status.second.isRelinearized)
+            continue;
+        if (gtsam::Symbol(status.first).chr() == 'x')
+            changedPoseKeys.insert(status.first);
+        else
+            staleKeys.insert(status.first);
+    }
+}
+
+void Graph::_refreshEstimate()
+{
+    // Back-substitution stops at small changes without reporting the variables it moved, so before an
+    // estimate is handed out every variable is read back once
+    for (const auto &value : _isam().getLinearizationPoint()){
+        if (gtsam::Symbol(value.key).chr() == 'x')
+            changedPoseKeys.insert(value.key);
+        else
+            staleKeys.insert(value.key);
+    }
+    _readChangedPoses();
+}
+
+const gtsam::Values &Graph::_currentEstimate()
+{
+    // Velocities, biases and landmarks are only read back here, the hot path asks ISAM2 for the latest ones directly
+    for (gtsam::Key key : staleKeys){
+        const gtsam::Value &value = _isam().calculateEstimate(key);
+        if (isamCurrentEstimate.exists(key))
+            isamCurrentEstimate.update(key, value);
+        else
+            isamCurrentEstimate.insert(key, value);
+        if (gtsam::Symbol(key).chr() == 'l')
+            movedLandmarkKeys.insert(key);
+    }
+    staleKeys.clear();
+    return isamCurrentEstimate;
+}
+
+gtsam::Pose3 Graph::getCurrentPose()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return currentPoseInWorld;
+}
+
+void Graph::getKeyPoses(std::vector<std::pair<double, gtsam::Pose3> > &keyPoses)
+{
+    // Keyframe i is X(i+1), X(0) is the prior
+    std::lock_guard<std::mutex> lock(mtx);
+    _refreshEstimate();
+    keyPoses.clear();
+    for (std::size_t i = 0; i < timeKeyPosePairs.size(); i++){
+        if (isamCurrentEstimate.exists(X(i+1)))
+            keyPoses.push_back(std::make_pair(timeKeyPosePairs[i].first, isamCurrentEstimate.at<gtsam::Pose3>(X(i+1))));
+    }
+}
+
+std::size_t Graph::getMapSize()
+{
+    std::lock_guard<std::mutex> lock(mapMtx);
+    return cloudMapFull->size();
+}
+
+void Graph::_updateLocalMap()
+{
+    // Closest keyframes with points within the radius. Linear in the keyframes, which are few next to the points.
+    const Eigen::Vector3f position(currentPoseInWorld.x(), currentPoseInWorld.y(), currentPoseInWorld.z());
+    const float squaredRadius = localMapRadius*localMapRadius;
+    std::vector<std::pair<float, int> > candidates;
+    for (int i = 0; i < (int) cloudKeyPositions->size() && i < (int) cloudKeyFrames.size(); i++){
+        float squaredDistance = (cloudKeyPositions->points[i].getVector3fMap() - position).squaredNorm();
+        if (squaredDistance <= squaredRadius && !cloudKeyFrames[i]->empty())
+            candidates.push_back(std::make_pair(squaredDistance, i));
+    }
+    if ((int) candidates.size() > localMapMaxKeyFrames){
+        std::nth_element(candidates.begin(), candidates.begin() + localMapMaxKeyFrames, candidates.end());
+        candidates.resize(localMapMaxKeyFrames);
+    }
+    // Back-substitution stops at small changes without reporting the poses it moved, so the few poses
+    // the local map is built from are read back first, which also bumps their versions
+    for (const auto &candidate : candidates){
+        if (_isam().valueExists(X(candidate.second + 1)))
+            changedPoseKeys.insert(X(candidate.second + 1));
+    }
+    _readChangedPoses();
+    std::map<int, gtsam::Pose3> selected;
+    for (const auto &candidate : candidates){
+        selected[candidate.second] = isamCurrentEstimate.at<gtsam::Pose3>(X(candidate.second + 1));
+    }
+
+    // Keyframes that left, or moved with the estimate since they were inserted, go out
+    std::vector<int> leaving;
+    for (const auto &keyFrame : localKeyFrames){
+        auto kept = selected.find(keyFrame.first);
+        if (kept == selected.end())
+            leaving.push_back(keyFrame.first);
+        else if (keyPoseVersions[keyFrame.first] != keyFrame.second.version && !kept->second.equals(keyFrame.second.pose, 1e-2))
+            leaving.push_back(keyFrame.first);
+    }
+    for (int keyFrame : leaving){
+        _removeFromLocalMap(keyFrame);
+    }
+
+    // Gaps are squeezed out once they outnumber the points, the index is rebuilt with them
+    if (localKeyFramesMap->size() > 2*localMapIndex.size() + 10000){
+        std::map<int, LocalKeyFrame> remaining;
+        remaining.swap(localKeyFrames);
+        pcl::PointCloud<pointT>::Ptr oldMap = localKeyFramesMap;
+        localKeyFramesMap.reset(new pcl::PointCloud<pointT>());
+        localMapIndex.clear();
+        for (auto &keyFrame : remaining){
+            LocalKeyFrame &local = keyFrame.second;
+            int begin = localKeyFramesMap->size();
+            for (int i = local.begin; i < local.end; i++){
+                localMapIndex.insert(localKeyFramesMap->size(), oldMap->points[i].getVector3fMap());
+                localKeyFramesMap->push_back(oldMap->points[i]);
+            }
+            local.begin = begin;
+            local.end = localKeyFramesMap->size();
+        }
+        localKeyFrames.swap(remaining);
+    }
+
+    for (const auto &keyFrame : selected){
+        if (localKeyFrames.count(keyFrame.first) == 0)
+            _addToLocalMap(keyFrame.first, keyFrame.second);
+    }
+}
+
+void Graph::_addToLocalMap(int keyFrame, const gtsam::Pose3 &pose)
+{
+    pcl::PointCloud<pointT> keyFrameInWorld;
+    pcl::transformPointCloud(*cloudKeyFrames[keyFrame], keyFrameInWorld, pose.matrix());
+    LocalKeyFrame local;
+    local.begin = localKeyFramesMap->size();
+    local.pose = pose;
+    local.version = keyPoseVersions[keyFrame];
+    for (const auto &point : keyFrameInWorld.points){
+        localMapIndex.insert(localKeyFramesMap->size(), point.getVector3fMap());
+        localKeyFramesMap->push_back(point);
+    }
+    local.end = localKeyFramesMap->size();
+    localKeyFrames[keyFrame] = local;
+}
+
+void Graph::_removeFromLocalMap(int keyFrame)
+{
+    auto local = localKeyFrames.find(keyFrame);
+    if (local == localKeyFrames.end())
+        return;
+    for (int i = local->second.begin; i < local->second.end; i++){
+        localMapIndex.remove(i);
+    }
+    localKeyFrames.erase(local);
+}
 
+void Graph::_cloud2Map(){
     if (cloudKeyFrames.size() < 1 || currentFeatureCloud->empty()) return;
 
+    // Matched against the keyframes around the current pose rather than the whole map
+    _updateLocalMap();
+    if (localMapIndex.size() == 0) return;
+
 
     pcl::CorrespondencesPtr allCorrespondences(new pcl::Correspondences);
-    pcl::registration::CorrespondenceEstimation<pointT, pointT> matcher;
     pcl::CorrespondencesPtr partialOverlapCorrespondences(new pcl::Correspondences);
     pcl::registration::CorrespondenceRejectorTrimmed trimmer;
     trimmer.setInputCorrespondences(allCorrespondences);
     trimmer.setOverlapRatio(0.4);
-    matcher.setInputTarget(cloudMapRefined);
     pcl::PointCloud<pointT> framePoints = *currentFeatureCloud;
     pcl::PointCloud<pointT> frameInWorld;
+    std::vector<int> nearestInMap(framePoints.size());
+    std::vector<float> squaredDistances(framePoints.size());
+    std::unordered_map<int, int> matchedBy; // Map point to its correspondence
+    PointToMapNormalEquations normalEquations;
+    const PointToMapNormalEquations::Matrix6 poseCovariance = odometryNoise->covariance();
 
     int iter = 0;
     double lambda = 1e-4;
     for (iter = 0; iter<maxIterSmoothing; iter++){
 
         pcl::transformPointCloud(framePoints, frameInWorld, currentPoseInWorld.matrix());
-        matcher.setInputSource(frameInWorld.makeShared());
-        matcher.determineReciprocalCorrespondences(*allCorrespondences); 
+
+        // Nearest local map point of every scan point
+        const int nFramePoints = frameInWorld.size();
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < nFramePoints; i++){
+            nearestInMap[i] = localMapIndex.nearest(frameInWorld.points[i].getVector3fMap(), maxCorrespondenceDistance, &squaredDistances[i]);
+        }
+        // A map point keeps only its closest scan point, in place of the reciprocal search over the scan
+        allCorrespondences->clear();
+        matchedBy.clear();
+        for (int i = 0; i < nFramePoints; i++){
+            if (nearestInMap[i] < 0)
+                continue;
+            auto claimed = matchedBy.insert(std::make_pair(nearestInMap[i], (int) allCorrespondences->size()));
+            if (claimed.second)
+                allCorrespondences->push_back(pcl::Correspondence(i, nearestInMap[i], squaredDistances[i]));
+            else if (squaredDistances[i] < allCorrespondences->at(claimed.first->second).distance)
+                allCorrespondences->at(claimed.first->second) = pcl::Correspondence(i, nearestInMap[i], squaredDistances[i]);
+        }
         trimmer.getCorrespondences(*partialOverlapCorrespondences);
 
         int nPoints = partialOverlapCorrespondences->size();
         //std::cout << "Correspondences map alignment: " << nPoints << std::endl;
         if (nPoints < 10)
             break;
-        int pointD = 3; int poseD = 6; int priorD = updateImu ? 6:0;
-        int ARows = nPoints*pointD + priorD;
-        int BRows = ARows;
-        int ACols = poseD;// + pointD*nPoints;
-        int XCols = ACols;
-        std::vector<gtsam::Point3> worldPoints; 
-        worldPoints.reserve(nPoints);
-        std::vector<gtsam::Point3> localPoints; 
-        localPoints.reserve(nPoints); //reserve space
-        worldPoints.clear(); localPoints.clear();
-        cv::Mat matA = cv::Mat::zeros(ARows, ACols, CV_64FC1);
-        cv::Mat matAt(ACols, ARows, CV_64FC1, cv::Scalar::all(0.0));
-        cv::Mat matAtA(ACols, ACols, CV_64FC1, cv::Scalar::all(0));
-        cv::Mat matB(BRows, 1, CV_64FC1, cv::Scalar::all(0));
-        cv::Mat matAtB(ACols, 1, CV_64FC1, cv::Scalar::all(0));
-        cv::Mat matX(XCols, 1, CV_64FC1, cv::Scalar::all(0));
-
-        auto R_wLi = currentPoseInWorld.rotation();
-        auto t_wi  = currentPoseInWorld.translation();
-        for (int j = 0; j < nPoints; j++){
-            int sourceIndex = partialOverlapCorrespondences->at(j).index_query;
-            int targetIndex = partialOverlapCorrespondences->at(j).index_match;
-            pointT pointInWorld = frameInWorld.at(sourceIndex);
-            pointT pointInLocalFrame = framePoints.at(sourceIndex);
-            pointT matchedPointMap = cloudMapRefined->at(targetIndex);
-            //#TODO: Extract points first, then do optimization?
-
-            // Extract points
-            auto q_wj = gtsam::Point3(matchedPointMap.x, matchedPointMap.y, matchedPointMap.z);
-            auto p_wj = gtsam::Point3(pointInWorld.x, pointInWorld.y, pointInWorld.z);
-            auto p_Lij = gtsam::Point3(pointInLocalFrame.x, pointInLocalFrame.y, pointInLocalFrame.z);
-
-            worldPoints[j] = q_wj;
-            localPoints[j] = p_Lij;
-
-            gtsam::Matrix3 tmp = - (R_wLi.matrix() * skewSymmetric(p_Lij.x(), p_Lij.y(), p_Lij.z()));
-
-            // Calculate Jacobians
-            auto J_hij_TwLi = cv::Mat(pointD, poseD, CV_64F, cv::Scalar::all(0));
-            J_hij_TwLi.at<double>(0, 3) = R_wLi.matrix()(0, 0);
-            J_hij_TwLi.at<double>(0, 4) = R_wLi.matrix()(0, 1);
-            J_hij_TwLi.at<double>(0, 5) = R_wLi.matrix()(0, 2);
-            J_hij_TwLi.at<double>(1, 3) = R_wLi.matrix()(1, 0);
-            J_hij_TwLi.at<double>(1, 4) = R_wLi.matrix()(1, 1);
-            J_hij_TwLi.at<double>(1, 5) = R_wLi.matrix()(1, 2);
-            J_hij_TwLi.at<double>(2, 3) = R_wLi.matrix()(2, 0);
-            J_hij_TwLi.at<double>(2, 4) = R_wLi.matrix()(2, 1);
-            J_hij_TwLi.at<double>(2, 5) = R_wLi.matrix()(2, 2);
-            /*J_hij_TwLi.at<double>(0, 0) = 1;
-            J_hij_TwLi.at<double>(1, 1) = 1;
-            J_hij_TwLi.at<double>(2, 2) = 1;*/
-            J_hij_TwLi.at<double>(0, 0) = tmp(0, 0);
-            J_hij_TwLi.at<double>(0, 1) = tmp(0, 1);
-            J_hij_TwLi.at<double>(0, 2) = tmp(0, 2);
-            J_hij_TwLi.at<double>(1, 0) = tmp(1, 0);
-            J_hij_TwLi.at<double>(1, 1) = tmp(1, 1);
-            J_hij_TwLi.at<double>(1, 2) = tmp(1, 2);
-            J_hij_TwLi.at<double>(2, 0) = tmp(2, 0);
-            J_hij_TwLi.at<double>(2, 1) = tmp(2, 1);
-            J_hij_TwLi.at<double>(2, 2) = tmp(2, 2);
-
-            /*auto J_hij_xwj = cv::Mat(pointD, pointD, CV_64F, cv::Scalar::all(0));
-            J_hij_xwj.at<double>(0, 0) = R_wLi.matrix()(0, 0);
-            J_hij_xwj.at<double>(0, 1) = R_wLi.matrix()(0, 1);
-            J_hij_xwj.at<double>(0, 2) = R_wLi.matrix()(0, 2);
-            J_hij_xwj.at<double>(1, 0) = R_wLi.matrix()(1, 0);
-            J_hij_xwj.at<double>(1, 1) = R_wLi.matrix()(1, 1);
-            J_hij_xwj.at<double>(1, 2) = R_wLi.matrix()(1, 2);
-            J_hij_xwj.at<double>(2, 0) = R_wLi.matrix()(2, 0);
-            J_hij_xwj.at<double>(2, 1) = R_wLi.matrix()(2, 1);
-            J_hij_xwj.at<double>(2, 2) = R_wLi.matrix()(2, 2);*/
-
-            auto e = p_wj - q_wj;
-            auto b_ij = cv::Mat(pointD,1,CV_64F,cv::Scalar::all(0));
-            b_ij.at<double>(0,0) = -e.x();
-            b_ij.at<double>(1,0) = -e.y();
-            b_ij.at<double>(2,0) = -e.z();
-
-            // Extract submatrice to insert into
-            auto ProwRange = cv::Range(pointD*j, pointD*j + pointD);
-            auto PcolRange = cv::Range(0, poseD);
-            //auto SrowRange = ProwRange; 
-            //auto ScolRange = cv::Range(poseD + pointD*j, poseD + pointD*j + pointD);
-            auto bColRange = cv::Range::all();
-            auto bRowRange = cv::Range(j*pointD, j*pointD + pointD);
-            //auto bRowRange = cv::Range(k*nPoints*poseD + j*poseD, k*nPoints*poseD + j*poseD + poseD);
-
-            cv::Mat PsubMatA = matA.rowRange(ProwRange).colRange(PcolRange);
-            //cv::Mat SsubMatA = matA.colRange(ScolRange).rowRange(SrowRange);
-            cv::Mat bsubMatB = matB.colRange(bColRange).rowRange(bRowRange);
-
-            // Propagate uncertainty
-            cv::Mat sigmasPose(6, 6, CV_64F, cv::Scalar::all(0));
-            
-            cv::eigen2cv(odometryNoise->covariance(), sigmasPose);
-            cv::Mat sigmasPoseFloat;
-            sigmasPose.convertTo(sigmasPoseFloat, CV_64F);
-
-            /*cv::Mat sigmasPoints(3, 3, CV_64F, cv::Scalar::all(0));
-            cv::eigen2cv(structureNoise->covariance(), sigmasPoints);
-            cv::Mat sigmasPointsFloat;
-            sigmasPoints.convertTo(sigmasPointsFloat, CV_64F);*/
-
-            cv::Mat whitener = J_hij_TwLi * sigmasPoseFloat * J_hij_TwLi.t();
-            //                    + J_hij_xwj * sigmasPoints * J_hij_xwj.t();
-            cv::Mat whitenerInv;
-            cv::invert(whitener, whitenerInv, cv::DECOMP_SVD);
-            cv::Mat whitenerSqrtInv;
-            matrix_square_root(whitenerInv, whitenerSqrtInv);
-
-            // Copy into submatrices
-            cv::Mat Ai = whitenerSqrtInv * J_hij_TwLi;
-            Ai.copyTo(PsubMatA);
-
-            cv::Mat bi = whitenerSqrtInv * b_ij;
-            bi.copyTo(bsubMatB);
-
-            //cv::Mat Si = whitenerSqrtInv * J_hij_xwj;
-            //Si.copyTo(SsubMatA);
+
+        normalEquations.clear();
+        normalEquations.reserve(nPoints);
+        for (const auto &correspondence : *partialOverlapCorrespondences){
+            const pointT &pointInLocalFrame = framePoints.at(correspondence.index_query);
+            const pointT &matchedPointMap = localKeyFramesMap->at(correspondence.index_match);
+            normalEquations.add(pointInLocalFrame.getVector3fMap().cast<double>(), matchedPointMap.getVector3fMap().cast<double>());
         }
+
+        // J^T*J and J^T*b of the whitened point residuals, accumulated per correspondence
+        const Eigen::Matrix3d R_wLi = currentPoseInWorld.rotation().matrix();
+        const Eigen::Vector3d t_wi(currentPoseInWorld.x(), currentPoseInWorld.y(), currentPoseInWorld.z());
+        PointToMapNormalEquations::Matrix6 AtA;
+        PointToMapNormalEquations::Vector6 AtB;
+        normalEquations.linearize(R_wLi, t_wi, poseCovariance, AtA, AtB);
+
         // Add prior if imu data is available
         if (updateImu && imuEnabledFlag){
-            cv::Mat priorMatA = matA.rowRange(cv::Range(nPoints*pointD, nPoints*pointD + poseD)).colRange(cv::Range(0, poseD));
-            cv::setIdentity(priorMatA);
-            cv::Mat priorMatB = matB.rowRange(cv::Range(nPoints*pointD, nPoints*pointD + poseD));
             gtsam::Vector6 prior = - gtsam::Pose3::Logmap(predImuState.pose().inverse() * currentPoseInWorld);
             //auto preintImuCombined = dynamic_cast<const gtsam::PreintegratedImuMeasurements&>(*preintegrated);
             auto preintImuCombined = dynamic_cast<const gtsam::PreintegratedCombinedMeasurements&>(*preintegrated);
@@ -796,44 +1172,27 @@ void Graph::_cloud2Map(){
             gtsam::Matrix6 whitener = gtsam::inverse_square_root(cov);
             gtsam::Vector6 whitenedPrior = whitener * prior;
 
-            //std::cout << cov << std::endl;
-
-            priorMatB.at<double>(0, 0) = whitenedPrior(0);
-            priorMatB.at<double>(1, 0) = whitenedPrior(1);
-            priorMatB.at<double>(2, 0) = whitenedPrior(2);
-            priorMatB.at<double>(3, 0) = whitenedPrior(3);
-            priorMatB.at<double>(4, 0) = whitenedPrior(4);
-            priorMatB.at<double>(5, 0) = whitenedPrior(5);
+            // Identity rows with the whitened prior on the right hand side
+            AtA += PointToMapNormalEquations::Matrix6::Identity();
+            AtB += whitenedPrior;
         }
 
         // Solve using Levenberg Marquardt
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        auto matAtAdiag = cv::Mat::diag(matAtA.diag());
-        matAtB = matAt * matB;
-        cv::solve(matAtA + (lambda * matAtAdiag), matAtB, matX, cv::DECOMP_QR);
+        PointToMapNormalEquations::Matrix6 damped = AtA;
+        damped.diagonal() *= 1 + lambda;
+        gtsam::Vector6 xi = damped.ldlt().solve(AtB);
 
         // Check Update
         gtsam::Pose3 keyPoseBefore = currentPoseInWorld;
 
-        gtsam::Vector6 xi;
-        xi << matX.at<double>(0, 0), matX.at<double>(1, 0), matX.at<double>(2, 0), matX.at<double>(3, 0), matX.at<double>(4, 0), matX.at<double>(5, 0);
-
         gtsam::Pose3 tau = gtsam::Pose3::Expmap(xi);
 
         gtsam::Pose3 keyPoseAfter = currentPoseInWorld * tau;
 
-        double fxBefore = 0;
-        double fxAfter = 0;
+        double fxBefore = normalEquations.cost(R_wLi, t_wi);
+        double fxAfter = normalEquations.cost(keyPoseAfter.rotation().matrix(), Eigen::Vector3d(keyPoseAfter.x(), keyPoseAfter.y(), keyPoseAfter.z()));
         double fxResult = 0;
 
-        for (int i = 0; i < nPoints; i++){
-            gtsam::Point3 q_wj = worldPoints[i];
-            gtsam::Point3 p_Lij = localPoints[i];
-
-            fxBefore += pow(gtsam::norm3(keyPoseBefore * p_Lij - q_wj), 2);
-            fxAfter += pow(gtsam::norm3(keyPoseAfter * p_Lij - q_wj), 2);
-        }
         if (fxAfter < fxBefore){
             currentPoseInWorld = keyPoseAfter;
             lambda /= 10;
@@ -845,7 +1204,7 @@ void Graph::_cloud2Map(){
             fxResult = fxBefore;
         }
 
-        if (fxResult < fxTol || cv::norm(matX) < stepTol) {
+        if (fxResult < fxTol || xi.norm() < stepTol) {
             break;
         }
     }
@@ -865,6 +1224,7 @@ void Graph::runOnce(int &runsWithoutUpdate)
     if (newLaserOdometry && newMap && newGroundPlane){
         mtx.lock();
         newLaserOdometry=false, newMap=false, newGroundPlane = false;
+        _takeFeatureCloud();
 
         _incrementPosition();
         // #TODO: PROCESS IMU
@@ -883,12 +1243,11 @@ void Graph::runOnce(int &runsWithoutUpdate)
         _publishTrajectory();
         
         mtx.unlock();  
-        pcl::PointCloud<pointT> cloudInWorld;
-        pcl::transformPointCloud(*currentFeatureCloud, cloudInWorld, currentPoseInWorld.matrix());
-        sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(cloudInWorld, msg);
-        msg.header.frame_id = "map";
-        pubCurrentCloudInWorld.publish(msg);      
+        if (_wants(GraphOutput::CURRENT_CLOUD_IN_WORLD)){
+            pcl::PointCloud<pointT> cloudInWorld;
+            pcl::transformPointCloud(*currentFeatureCloud, cloudInWorld, currentPoseInWorld.matrix());
+            output->publishCloud(GraphOutput::CURRENT_CLOUD_IN_WORLD, cloudInWorld);
+        }
     }
 
     if (timeOdometry + 1.2 < gnssMeasurement.first && newGnss){
@@ -935,46 +1294,22 @@ void Graph::runOnce(int &runsWithoutUpdate)
             initialEstimate.insert(V(index), predImuState.v());
             initialEstimate.insert(B(index), prevImuBias);
 
-            PointXYZRPY currentPose;
-            isam->update(_graph, initialEstimate);
-            isam->update();
+            _updateIsam(_graph, initialEstimate, keyFrameIsamIterations);
             _graph.resize(0);
             initialEstimate.clear();
 
-            isamCurrentEstimate = isam->calculateEstimate();
-            prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), isamCurrentEstimate.at<gtsam::Vector3>(V(index)));
-            prevImuBias = isamCurrentEstimate.at<gtsam::imuBias::ConstantBias>(B(index));
+            prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), _isam().calculateEstimate<gtsam::Vector3>(V(index)));
+            prevImuBias = _isam().calculateEstimate<gtsam::imuBias::ConstantBias>(B(index));
             preintegrated->resetIntegrationAndSetBias(prevImuBias);
 
             currentPoseInWorld = isamCurrentEstimate.at<gtsam::Pose3>(X(index));
-            cloudKeyPositions->push_back(pcl::PointXYZ(currentPoseInWorld.x(), currentPoseInWorld.y(), currentPoseInWorld.z()));
-            _fromPose3ToPointXYZRPY(currentPoseInWorld, currentPose);
-            cloudKeyPoses->push_back(currentPose);
 
             pcl::PointCloud<pointT>::Ptr thisKeyFrame(new pcl::PointCloud<pointT>());
             cloudKeyFrames.push_back(thisKeyFrame);
             cloudsInQueue += 1;
             
-            geometry_msgs::PoseWithCovarianceStamped poseWCov;
-            poseWCov.header.frame_id = "map";
-            poseWCov.header.stamp = timer.fromSec(*imuComparisonTimerPtr);
-            poseWCov.pose.pose.position.z   = currentPoseInWorld.z();
-            poseWCov.pose.pose.position.y   = currentPoseInWorld.y();
-            poseWCov.pose.pose.position.x   = currentPoseInWorld.x();
-            poseWCov.pose.pose.orientation.w  = currentPoseInWorld.rotation().toQuaternion().w();
-            poseWCov.pose.pose.orientation.x  = currentPoseInWorld.rotation().toQuaternion().x();
-            poseWCov.pose.pose.orientation.y  = currentPoseInWorld.rotation().toQuaternion().y();
-            poseWCov.pose.pose.orientation.z  = currentPoseInWorld.rotation().toQuaternion().z();
-            int row = 0;
-            int col = 0;
-            gtsam::Matrix cov = isam->marginalCovariance(X(index));
-            std::map<int, int> map = {{0, 3}, {1,4}, {2, 5}, {3, 0}, {4, 1}, {5, 2}};
-            for (int i=0; i<36; i++){
-                row = i / 6;
-                col = i % 6;
-                poseWCov.pose.covariance.at(i)= (double) cov(map[row],map[col]);
-            }
-            pubTransformedPose.publish(poseWCov);
+            if (_wants(GraphOutput::POSE))
+                _publishPose(*imuComparisonTimerPtr, currentPoseInWorld, X(index));
         }
         mtx.unlock();
     }
@@ -995,31 +1330,16 @@ void Graph::_performIsamTimedOut(){
     _graph.add(combinedImuFactor);
     initialEstimate.insert(V(index), predImuState.v());
     initialEstimate.insert(B(index), prevImuBias);
-    PointXYZRPY currentPose;
-    isam->update(_graph, initialEstimate);
-    isam->update();
+    _updateIsam(_graph, initialEstimate, keyFrameIsamIterations);
 
     _graph.resize(0);
     initialEstimate.clear();
 
-    isamCurrentEstimate = isam->calculateEstimate();
-    prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), isamCurrentEstimate.at<gtsam::Vector3>(V(index)));
-    prevImuBias = isamCurrentEstimate.at<gtsam::imuBias::ConstantBias>(B(index));
+    prevImuState = gtsam::NavState(isamCurrentEstimate.at<gtsam::Pose3>(X(index)), _isam().calculateEstimate<gtsam::Vector3>(V(index)));
+    prevImuBias = _isam().calculateEstimate<gtsam::imuBias::ConstantBias>(B(index));
     preintegrated->resetIntegrationAndSetBias(prevImuBias);
     currentPoseInWorld = isamCurrentEstimate.at<gtsam::Pose3>(X(index));
 
-    int numPoses = cloudKeyPositions->size() + 1;
-    cloudKeyPositions->clear();
-    cloudKeyPoses->clear();
-    for (int i = 0; i < numPoses; i++){
-        gtsam::Pose3 pose;
-        pose = isamCurrentEstimate.at<gtsam::Pose3>(X(i+1));
-        cloudKeyPositions->push_back(pcl::PointXYZ(pose.x(), pose.y(), pose.z()));
-        
-        _fromPose3ToPointXYZRPY(pose, currentPose);
-
-        cloudKeyPoses->push_back(currentPose);
-    }
     timeKeyPosePairs.push_back(std::pair<double, gtsam::Pose3>(gnssMeasurement.first, currentPoseInWorld));
 
     lastPoseInWorld = currentPoseInWorld;
@@ -1072,129 +1392,92 @@ void Graph::_postProcessImuTimedOut(){
 void Graph::runRefine()
 {
     if (smoothingEnabledFlag == false) return;
-    ROS_INFO("Refinement of Map Enabled");
-    ros::Rate rate(1);
-    while (ros::ok()){
-        _mapToGraph();
+    std::cout << "Refinement of Map Enabled" << std::endl;
+    do {
+        if (keyFrameFactorsEnabledFlag)
+            _keyFramesToGraph();
+        else
+            _mapToGraph();
         //_investigateLoopClosures()
         mtx.lock();
-        cloudMapRefined->clear();
-        for (auto key : mapKeys){
-            auto gtsampoint = isamCurrentEstimate.at<gtsam::Point3>(key.first);
-            auto pclpoint = pcl::PointXYZ(gtsampoint.x(), gtsampoint.y(), gtsampoint.z());
-            cloudMapRefined->push_back(pclpoint);
+        // Landmarks are only appended to mapKeys, new ones are added and only the ones ISAM2 moved are rewritten
+        const gtsam::Values &estimate = _currentEstimate();
+        for (std::size_t i = cloudMapRefined->size(); i < mapKeys.size(); i++){
+            refinedIndex[mapKeys[i].first] = i;
+            movedLandmarkKeys.insert(mapKeys[i].first);
+        }
+        cloudMapRefined->resize(mapKeys.size());
+        cloudMapRefined->width = mapKeys.size();
+        cloudMapRefined->height = 1;
+        for (gtsam::Key key : movedLandmarkKeys){
+            auto landmark = refinedIndex.find(key);
+            if (landmark == refinedIndex.end())
+                continue;
+            auto gtsampoint = estimate.at<gtsam::Point3>(key);
+            cloudMapRefined->points[landmark->second] = pcl::PointXYZ(gtsampoint.x(), gtsampoint.y(), gtsampoint.z());
         }
+        movedLandmarkKeys.clear();
         mtx.unlock();
         _publishReworkedMap();
-        rate.sleep();
-    }
+    } while (_sleepFor(1));
 }
 
 void Graph::_transformMapToWorld()
 {
     pcl::PointCloud<pointT> currentInWorld;
     pcl::transformPointCloud(*currentFeatureCloud, currentInWorld, currentPoseInWorld.matrix());
-    /*for (auto &it : currentInWorld.points){
-        octreeMap->addPointToCloud(it, cloudKeyFramesMap);
-    }*/
-    
-    
-    if (cloudMapFull->empty()){
-        *cloudMapFull += currentInWorld;
-        return;
-    }
-    pcl::PointCloud<pointT>::Ptr currentMap(new pcl::PointCloud<pointT>(*cloudMapFull));
-    pcl::KdTreeFLANN<pointT> kdTree;
-    kdTree.setInputCloud(cloudMapFull);
-    std::vector<int> indices;
-    std::vector<float> distances;
-    for (auto &it : currentInWorld.points){
-        if (!pcl::isFinite<pointT>(it)) continue;
+    _addToFullMap(currentInWorld, fullMapMinDistance);
+}
 
-        if (kdTree.nearestKSearch(it, 1, indices, distances) > 0) {
-            if (sqrt(distances[0]) > 0.5){
-                cloudMapFull->push_back(it);
-            }
-        }
-        else{
-            cloudMapFull->push_back(it);
-        }
+void Graph::_addToFullMap(const pcl::PointCloud<pointT> &cloudInWorld, float minDistance)
+{
+    // Checked against the map as it was before this cloud, so the cloud itself is not thinned out
+    std::lock_guard<std::mutex> lock(mapMtx);
+    newMapPoints.clear();
+    for (const auto &it : cloudInWorld.points){
+        if (!pcl::isFinite<pointT>(it)) continue;
+        if (!fullMapIndex.anyWithin(it.getVector3fMap(), minDistance))
+            newMapPoints.push_back(it);
+    }
+    for (const auto &it : newMapPoints){
+        fullMapIndex.insert(cloudMapFull->size(), it.getVector3fMap());
+        cloudMapFull->push_back(it);
+        isLandmark.push_back(0);
     }
-    
 }
 
 void Graph::_publishTransformed()
 {
     // Publish the entire map
-    if (pubTransformedMap.getNumSubscribers() > 0){
-        sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(*cloudMapFull, msg);
-        msg.header.frame_id = "map";
-        pubTransformedMap.publish(msg);
+    if (_wants(GraphOutput::MAP)){
+        output->publishCloud(GraphOutput::MAP, *cloudMapFull);
     }
 
     // Publish the newest pose from the ISAM2 estimate
     // TODO: Need another publisher for publishing key poses, or a publisher for intermediate pose estimates.
-    if (pubTransformedPose.getNumSubscribers() > 0 && newKeyPose){
-        geometry_msgs::PoseWithCovarianceStamped poseWCov;
+    if (_wants(GraphOutput::POSE) && newKeyPose){
         newKeyPose=false;
-        poseWCov.header.frame_id = "map";
-        poseWCov.header.stamp = timer.fromSec(*imuComparisonTimerPtr);
-
         auto estimate = isamCurrentEstimate.at<gtsam::Pose3>(X(cloudKeyPoses->points.size()));
-        auto cov = isam->marginalCovariance(X(cloudKeyPoses->points.size()));
-
-        poseWCov.pose.pose.position.z   = estimate.z();
-        poseWCov.pose.pose.position.y   = estimate.y();
-        poseWCov.pose.pose.position.x   = estimate.x();
-        poseWCov.pose.pose.orientation.w  = estimate.rotation().toQuaternion().w();
-        poseWCov.pose.pose.orientation.x  = estimate.rotation().toQuaternion().x();
-        poseWCov.pose.pose.orientation.y  = estimate.rotation().toQuaternion().y();
-        poseWCov.pose.pose.orientation.z  = estimate.rotation().toQuaternion().z();
-        int row = 0;
-        int col = 0;
-        std::map<int, int> map = {{0, 3}, {1,4}, {2, 5}, {3, 0}, {4, 1}, {5, 2}};
-        for (int i=0; i<36; i++){
-            row = i / 6;
-            col = i % 6;
-            poseWCov.pose.covariance.at(i)= (double) cov(map[row], map[col]);
-        }
-        pubTransformedPose.publish(poseWCov);
+        _publishPose(*imuComparisonTimerPtr, estimate, X(cloudKeyPoses->points.size()));
     }
 }
 
 void Graph::_publishReworkedMap()
 {
-    if (pubReworkedMap.getNumSubscribers() > 0){
-        sensor_msgs::PointCloud2 msg;
-        pcl::toROSMsg(*cloudMapRefined, msg);
-        msg.header.frame_id = "map";
-        pubReworkedMap.publish(msg);
+    if (_wants(GraphOutput::REWORKED_MAP)){
+        output->publishCloud(GraphOutput::REWORKED_MAP, *cloudMapRefined);
     }
 }
 
 void Graph::_publishTrajectory()
 {
-    if (!(pubPoseArray.getNumSubscribers() > 0) || cloudKeyPoses->points.size() % 10 != 0) return;
-    geometry_msgs::PoseArray poseArray;
-    poseArray.header.stamp = timer.now();
-    poseArray.header.frame_id = "map";
-    int poses = cloudKeyPoses->points.size()+1;
-    for (int i = 0; i<poses; i++){
-        PointXYZRPY it;
-        _fromPose3ToPointXYZRPY(isamCurrentEstimate.at<gtsam::Pose3>(X(i)), it);
-        geometry_msgs::Pose pose;
-        pose.position.x = it.x;
-        pose.position.y = it.y;
-        pose.position.z = it.z;
-        tf::Quaternion quat = tf::createQuaternionFromRPY(it.roll, it.pitch, it.yaw);
-        pose.orientation.x = quat.x();
-        pose.orientation.y = quat.y();
-        pose.orientation.z = quat.z();
-        pose.orientation.w = quat.w();
-        poseArray.poses.push_back(pose);
-    }
-    pubPoseArray.publish(poseArray);
+    if (!_wants(GraphOutput::POSE_ARRAY) || cloudKeyPoses->points.size() % 10 != 0) return;
+    std::vector<gtsam::Pose3> poses;
+    int nPoses = cloudKeyPoses->points.size()+1;
+    for (int i = 0; i<nPoses; i++){
+        poses.push_back(isamCurrentEstimate.at<gtsam::Pose3>(X(i)));
+    }
+    output->publishPoseArray(poses);
 }
 
 void Graph::_fromPointXYZRPYToPose3(const PointXYZRPY &poseIn, gtsam::Pose3 &poseOut)
@@ -1221,12 +1504,25 @@ void Graph::_fromPose3ToPointXYZRPY(const gtsam::Pose3 &poseIn, PointXYZRPY &pos
 
 void Graph::writeToFile()
 {   
-    isam->saveGraph("/home/sjurinho/Documents/isamgraph.dot");
+    std::lock_guard<std::mutex> lock(mtx);
+    _refreshEstimate();
+    _isam().saveGraph("/home/sjurinho/Documents/isamgraph.dot");
 
     std::ofstream csvFile("/home/sjurinho/master_ws/src/tunnel_slam/data/LatestRun.csv");
     std::cout << "Failed to open file: " << csvFile.fail() << std::endl;
     csvFile << "key,landmark(x;y;z),pose(x;y;z;r;p;y;cov[36]),velocity(u;v;w),bias(bu;bv;bw;br;bp;by)\n";
-    for (auto it : isamCurrentEstimate){
+
+    // Pose covariances in one batch, except the ones still cached from publishing
+    gtsam::KeyVector uncachedPoses;
+    for (auto it : _currentEstimate()){
+        auto cached = covarianceCache.find(it.key);
+        if (gtsam::Symbol(it.key).chr() == 'x' && !_frozen(it.key) && (cached == covarianceCache.end() || cached->second.first != isamVersion))
+            uncachedPoses.push_back(it.key);
+    }
+    std::vector<gtsam::Matrix> covariances;
+    _jointCovariances(uncachedPoses, covariances);
+
+    for (auto it : _currentEstimate()){
         std::string key = gtsam::DefaultKeyFormatter(it.key);
         std::string row;
         switch (key.front()){
@@ -1239,7 +1535,7 @@ void Graph::writeToFile()
             case 'x':
             {
                 auto x = it.value.cast<gtsam::Pose3>();
-                auto cov = isam->marginalCovariance(it.key);
+                const gtsam::Matrix &cov = _marginalCovariance(it.key);
                 std::map<int, int> map = {{0, 3}, {1,4}, {2, 5}, {3, 0}, {4, 1}, {5, 2}};
                 
                 row = key + ",," + std::to_string(x.translation().x()) + ";" + std::to_string(x.translation().y()) + ";" + std::to_string(x.translation().z()) + ";" + std::to_string(x.rotation().roll()) + ";" + std::to_string(x.rotation().pitch()) + ";" + std::to_string(x.rotation().yaw()) + ";";
@@ -1276,6 +1572,6 @@ void Graph::writeToFile()
         }
         csvFile << row + "\n";
     }
-    isam->saveGraph("IsamGraph");
+    _isam().saveGraph("IsamGraph");
     csvFile.close();
 }
\ No newline at end of file
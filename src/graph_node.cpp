@@ -1,5 +1,5 @@
 // Node file to create object and initialising the ROS node
-#include "graph.hpp"
+#include "graph_ros.hpp"
 #include <thread>
 
 int main(int argc, char** argv)
@@ -11,9 +11,10 @@ int main(int argc, char** argv)
     ros::NodeHandle nh;
     ros::NodeHandle pnh("~"); 
     
-    Graph node(nh,pnh); // Creating the object
-    std::thread refineThread(&Graph::runRefine, &node);
-    std::thread loopClosureThread(&Graph::runLoopClosure, &node);
+    GraphRos node(nh,pnh); // Creating the object
+    Graph &graph = node.graph();
+    std::thread refineThread(&Graph::runRefine, &graph);
+    std::thread loopClosureThread(&Graph::runLoopClosure, &graph);
 
     ros::Rate rate(10); // Defing the looping rate
 
@@ -23,13 +24,14 @@ int main(int argc, char** argv)
     {   
         //ros::spin();
         ros::spinOnce();
-        node.runOnce(runsWithoutUpdate);
+        graph.runOnce(runsWithoutUpdate);
         rate.sleep();
     }
+    graph.stop();
     refineThread.join();
     loopClosureThread.join();
     std::cout << "SHUTTING DOWN - SAVING GRAPH" << std::endl;
-    node.writeToFile();
+    graph.writeToFile();
     return 0;
 
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "graph_ros.hpp"
+
+#include <pcl_conversions/pcl_conversions.h>
+#include <geometry_msgs/PoseArray.h>
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
+
+//constructor method
+GraphRos::GraphRos(ros::NodeHandle &nh, ros::NodeHandle &pnh) : graph_(_readParameters(pnh), this)
+{   
+    nh_ = nh;
+    ROS_INFO("Initializing Graph Node");
+
+    //Subscribers and publishers
+    subOdometry = nh.subscribe<nav_msgs::Odometry>("/lidarOdom", 32, &GraphRos::odometryHandler, this);
+    subMap = nh.subscribe<sensor_msgs::PointCloud2>("/featurePointCloud", 32, &GraphRos::mapHandler, this);
+    subGroundPlane = nh.subscribe<sensor_msgs::PointCloud2>("/groundPlanePointCloud", 32, &GraphRos::groundPlaneHandler, this);
+    subImu = nh.subscribe<sensor_msgs::Imu>("/imu", 32, &GraphRos::imuHandler, this);
+    subGnss = nh.subscribe<geometry_msgs::PoseStamped>("/gnss", 32, &GraphRos::gnssHandler, this);
+    pubTransformedMap = nh.advertise<sensor_msgs::PointCloud2>("/map", 1);
+    pubTransformedPose = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/pose", 1);
+    pubPoseArray = nh.advertise<geometry_msgs::PoseArray>("/poseArray", 1);
+    pubReworkedMap = nh.advertise<sensor_msgs::PointCloud2>("/reworkedMap", 1);
+    pubCurrentCloudInWorld = nh.advertise<sensor_msgs::PointCloud2>("/currentFeatureCloudInWorld", 1);
+    pubPotentialLoopCloud = nh.advertise<sensor_msgs::PointCloud2>("/potentialLoopCloud", 1);
+    pubLatestKeyFrameCloud = nh.advertise<sensor_msgs::PointCloud2>("/latestKeyFrameCloud", 1);
+    pubICPResultCloud = nh.advertise<sensor_msgs::PointCloud2>("/icpResultCloud", 1);
+}
+
+// Destructor method
+GraphRos::~GraphRos()
+{
+
+}
+
+GraphParameters GraphRos::_readParameters(ros::NodeHandle &pnh)
+{
+    GraphParameters p;
+    pnh.param("fixed_lag", p.fixedLagEnabledFlag, p.fixedLagEnabledFlag);
+    pnh.param("fixed_lag_keyframes", p.fixedLagKeyFrames, p.fixedLagKeyFrames);
+    pnh.param("keyframe_factors", p.keyFrameFactorsEnabledFlag, p.keyFrameFactorsEnabledFlag);
+    pnh.param("keyframe_factor_neighbours", p.keyFrameFactorNeighbours, p.keyFrameFactorNeighbours);
+    pnh.param("keyframe_alignment_iterations", p.keyFrameAlignmentIterations, p.keyFrameAlignmentIterations);
+    pnh.param("structure_variance", p.structureVariance, p.structureVariance);
+    pnh.param("keyframe_fitness_score", p.keyFrameFitnessScore, p.keyFrameFitnessScore);
+    pnh.param("keyframe_min_information", p.keyFrameMinInformation, p.keyFrameMinInformation);
+    pnh.param("keyframe_isam_iterations", p.keyFrameIsamIterations, p.keyFrameIsamIterations);
+    pnh.param("refine_isam_iterations", p.refineIsamIterations, p.refineIsamIterations);
+    pnh.param("loop_closure_isam_iterations", p.loopClosureIsamIterations, p.loopClosureIsamIterations);
+    return p;
+}
+
+void GraphRos::odometryHandler(const nav_msgs::OdometryConstPtr &odomMsg)
+{
+    gtsam::Point3 pos(odomMsg->pose.pose.position.x, odomMsg->pose.pose.position.y, odomMsg->pose.pose.position.z);
+    gtsam::Rot3 rot = gtsam::Rot3::Quaternion(odomMsg->pose.pose.orientation.w, odomMsg->pose.pose.orientation.x, odomMsg->pose.pose.orientation.y, odomMsg->pose.pose.orientation.z);
+    graph_.addOdometry(odomMsg->header.stamp.toSec(), gtsam::Pose3(rot, pos));
+}
+
+void GraphRos::mapHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+{   
+    graph_.addFeatureCloud(pointCloud2Msg->header.stamp.toSec(), pointCloud2View(pointCloud2Msg));
+}
+
+void GraphRos::groundPlaneHandler(const sensor_msgs::PointCloud2ConstPtr& pointCloud2Msg)
+{   
+    graph_.addGroundPlane(pointCloud2Msg->header.stamp.toSec(), pointCloud2View(pointCloud2Msg));
+}
+
+void GraphRos::imuHandler(const sensor_msgs::ImuConstPtr &imuMsg){
+    gtsam::Vector6 measurement;
+    measurement << imuMsg->linear_acceleration.x, imuMsg->linear_acceleration.y, imuMsg->linear_acceleration.z, imuMsg->angular_velocity.x, imuMsg->angular_velocity.y, imuMsg->angular_velocity.z; //IMU measurement in Lidar frame
+    graph_.addImu(imuMsg->header.stamp.toSec(), measurement);
+}
+
+void GraphRos::gnssHandler(const geometry_msgs::PoseStampedConstPtr &gnssMsg)
+{
+    graph_.addGnss(gnssMsg->header.stamp.toSec(), gtsam::Point3(gnssMsg->pose.position.x, gnssMsg->pose.position.y, gnssMsg->pose.position.z));
+}
+
+const ros::Publisher &GraphRos::_publisher(Topic topic) const
+{
+    switch (topic){
+        case MAP: return pubTransformedMap;
+        case REWORKED_MAP: return pubReworkedMap;
+        case CURRENT_CLOUD_IN_WORLD: return pubCurrentCloudInWorld;
+        case POTENTIAL_LOOP_CLOUD: return pubPotentialLoopCloud;
+        case LATEST_KEY_FRAME_CLOUD: return pubLatestKeyFrameCloud;
+        case ICP_RESULT_CLOUD: return pubICPResultCloud;
+        case POSE: return pubTransformedPose;
+        default: return pubPoseArray;
+    }
+}
+
+bool GraphRos::wants(Topic topic) const
+{
+    // The loop closure clouds and the current cloud were always published, the rest only with subscribers
+    switch (topic){
+        case CURRENT_CLOUD_IN_WORLD:
+        case POTENTIAL_LOOP_CLOUD:
+        case LATEST_KEY_FRAME_CLOUD:
+        case ICP_RESULT_CLOUD:
+            return true;
+        default:
+            return _publisher(topic).getNumSubscribers() > 0;
+    }
+}
+
+void GraphRos::publishCloud(Topic topic, const pcl::PointCloud<pointT> &cloud)
+{
+    sensor_msgs::PointCloud2 msg;
+    pcl::toROSMsg(cloud, msg);
+    msg.header.frame_id = "map";
+    _publisher(topic).publish(msg);
+}
+
+void GraphRos::publishPose(double stamp, const gtsam::Pose3 &pose, const gtsam::Matrix &covariance)
+{
+    geometry_msgs::PoseWithCovarianceStamped poseWCov;
+    poseWCov.header.frame_id = "map";
+    poseWCov.header.stamp = ros::Time(stamp);
+    poseWCov.pose.pose.position.z   = pose.z();
+    poseWCov.pose.pose.position.y   = pose.y();
+    poseWCov.pose.pose.position.x   = pose.x();
+    poseWCov.pose.pose.orientation.w  = pose.rotation().toQuaternion().w();
+    poseWCov.pose.pose.orientation.x  = pose.rotation().toQuaternion().x();
+    poseWCov.pose.pose.orientation.y  = pose.rotation().toQuaternion().y();
+    poseWCov.pose.pose.orientation.z  = pose.rotation().toQuaternion().z();
+    // ROS orders the covariance translation first
+    int row = 0;
+    int col = 0;
+    std::map<int, int> map = {{0, 3}, {1,4}, {2, 5}, {3, 0}, {4, 1}, {5, 2}};
+    for (int i=0; i<36; i++){
+        row = i / 6;
+        col = i % 6;
+        poseWCov.pose.covariance.at(i)= (double) covariance(map[row], map[col]);
+    }
+    pubTransformedPose.publish(poseWCov);
+}
+
+void GraphRos::publishPoseArray(const std::vector<gtsam::Pose3> &poses)
+{
+    geometry_msgs::PoseArray poseArray;
+    poseArray.header.stamp = ros::Time::now();
+    poseArray.header.frame_id = "map";
+    for (const auto &it : poses){
+        geometry_msgs::Pose pose;
+        pose.position.x = it.x();
+        pose.position.y = it.y();
+        pose.position.z = it.z();
+        gtsam::Quaternion quat = it.rotation().toQuaternion();
+        pose.orientation.x = quat.x();
+        pose.orientation.y = quat.y();
+        pose.orientation.z = quat.z();
+        pose.orientation.w = quat.w();
+        poseArray.poses.push_back(pose);
+    }
+    pubPoseArray.publish(poseArray);
+}
@@ -0,0 +1,184 @@
+// Offline benchmark: plays a recorded bag through the front-end and the graph as fast as they
+// take it, without a ROS master, and reports scans/s, stage latencies and the final trajectory.
+//
+//     tunnel_slam_replay <bag> [trajectory.txt] [key=value ...]
+//
+// Keys are the GraphParameters in snake case, e.g. fixed_lag=true fixed_lag_keyframes=100 keyframe_factors=true.
+// Scans, IMU and GNSS are read from the same topics the nodes subscribe to. The trajectory is
+// written as "time x y z qx qy qz qw", one keyframe per line.
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/Imu.h>
+#include <geometry_msgs/PoseStamped.h>
+
+#include "feature_association.hpp"
+#include "graph.hpp"
+#include "point_cloud2_view.hpp"
+
+int main(int argc, char** argv)
+{
+    std::string trajectoryFile = "trajectory.txt";
+    GraphParameters graphParameters;
+    bool valid = argc >= 2;
+    for (int i = 2; i < argc && valid; i++){
+        std::string argument = argv[i];
+        if (i == 2 && argument.find('=') == std::string::npos)
+            trajectoryFile = argument;
+        else if (!setGraphParameter(graphParameters, argument)){
+            std::cerr << "Unknown or invalid parameter " << argument << std::endl;
+            valid = false;
+        }
+    }
+    if (!valid){
+        std::cerr << "usage: " << argv[0] << " <bag> [trajectory.txt] [fixed_lag=false] [fixed_lag_keyframes=200] [keyframe_factors=false] ..." << std::endl;
+        return 1;
+    }
+
+    Graph graph(graphParameters);
+    int runsWithoutUpdate = 0;
+    uint64_t nMatched = 0, nRejected = 0;
+#ifdef TUNNEL_SLAM_PROFILING
+    StageProfiler graphProfiler;
+#endif
+
+    // IMU and GNSS are handed to the graph in step with the odometry, as they would arrive live,
+    // so a front-end that runs behind the bag does not see measurements from its future
+    std::mutex sensorMtx;
+    std::deque<std::pair<double, gtsam::Vector6> > imuQueue;
+    std::deque<std::pair<double, gtsam::Point3> > gnssQueue;
+    auto feedSensorsUntil = [&](double time){
+        std::lock_guard<std::mutex> lock(sensorMtx);
+        while (!imuQueue.empty() && imuQueue.front().first <= time){
+            graph.addImu(imuQueue.front().first, imuQueue.front().second);
+            imuQueue.pop_front();
+        }
+        while (!gnssQueue.empty() && gnssQueue.front().first <= time){
+            graph.addGnss(gnssQueue.front().first, gnssQueue.front().second);
+            gnssQueue.pop_front();
+        }
+    };
+
+    // Runs on the matching thread of the front-end, in scan order
+    auto odometryCallback = [&](const ScanOdometry &odometry){
+        feedSensorsUntil(odometry.stamp);
+
+        // Same checks as the node applies before publishing odometry, the clouds go through regardless
+        const Eigen::Vector3d delta = odometry.transformation.translation();
+        bool stable = delta.allFinite() && delta.cwiseAbs().maxCoeff() <= 5 && std::fabs(delta.x()) + std::fabs(delta.y()) <= 7;
+        if (stable){
+            Eigen::Quaterniond rotation(odometry.transformation.rotation());
+            graph.addOdometry(odometry.stamp, gtsam::Pose3(gtsam::Rot3(rotation), gtsam::Point3(delta)));
+            nMatched++;
+        }
+        else {
+            nRejected++;
+        }
+        // The graph keeps a view of the clouds, they are only copied once it processes them
+        graph.addFeatureCloud(odometry.stamp, PointArrayView(odometry.featureCloud));
+        graph.addGroundPlane(odometry.stamp, PointArrayView(odometry.groundPlane));
+
+        PROFILE_STAGE(graphProfiler, "run_once");
+        graph.runOnce(runsWithoutUpdate);
+    };
+
+    FeatureAssociation featureAssociation(FeatureAssociationParameters(), odometryCallback);
+    std::thread refineThread(&Graph::runRefine, &graph);
+    std::thread loopClosureThread(&Graph::runLoopClosure, &graph);
+
+    rosbag::Bag bag;
+    try {
+        bag.open(argv[1], rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException &e){
+        std::cerr << "Failed to open " << argv[1] << ": " << e.what() << std::endl;
+        graph.stop();
+        refineThread.join();
+        loopClosureThread.join();
+        return 1;
+    }
+    std::vector<std::string> topics = {"/points2", "/imu", "/gnss"};
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+    uint64_t nScans = 0;
+    double firstStamp = -1, lastStamp = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (const rosbag::MessageInstance &m : view){
+        if (sensor_msgs::PointCloud2ConstPtr scan = m.instantiate<sensor_msgs::PointCloud2>()){
+            // Blocks while the scan buffer is full, so no scan is dropped
+            double stamp = scan->header.stamp.toSec();
+            featureAssociation.addScan(pointCloud2View(scan), stamp, true);
+            if (firstStamp < 0)
+                firstStamp = stamp;
+            lastStamp = stamp;
+            nScans++;
+        }
+        else if (sensor_msgs::ImuConstPtr imu = m.instantiate<sensor_msgs::Imu>()){
+            gtsam::Vector6 measurement;
+            measurement << imu->linear_acceleration.x, imu->linear_acceleration.y, imu->linear_acceleration.z, imu->angular_velocity.x, imu->angular_velocity.y, imu->angular_velocity.z;
+            std::lock_guard<std::mutex> lock(sensorMtx);
+            imuQueue.push_back(std::make_pair(imu->header.stamp.toSec(), measurement));
+        }
+        else if (geometry_msgs::PoseStampedConstPtr gnss = m.instantiate<geometry_msgs::PoseStamped>()){
+            std::lock_guard<std::mutex> lock(sensorMtx);
+            gnssQueue.push_back(std::make_pair(gnss->header.stamp.toSec(), gtsam::Point3(gnss->pose.position.x, gnss->pose.position.y, gnss->pose.position.z)));
+        }
+    }
+    featureAssociation.flush();
+    feedSensorsUntil(std::numeric_limits<double>::infinity());
+    graph.runOnce(runsWithoutUpdate);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bag.close();
+
+    graph.stop();
+    refineThread.join();
+    loopClosureThread.join();
+
+    // Report
+    double recorded = nScans > 1 ? lastStamp - firstStamp : 0;
+    std::cout << "Scans: " << nScans << " in " << seconds << " s, " << (seconds > 0 ? nScans / seconds : 0) << " scans/s";
+    if (recorded > 0)
+        std::cout << " (" << recorded / seconds << "x real time)";
+    std::cout << std::endl;
+    std::cout << "Odometry: " << nMatched << " used, " << nRejected << " rejected as unstable, "
+              << featureAssociation.getRegistrationFailures() << " registration failures, "
+              << featureAssociation.getFastPathHits() << " fast path / " << featureAssociation.getFastPathMisses() << " descriptor registrations" << std::endl;
+#ifdef TUNNEL_SLAM_PROFILING
+    std::vector<StageStatus> statistics;
+    featureAssociation.getProfiler().report("feature_association", statistics);
+    graphProfiler.report("graph", statistics);
+    for (const auto &status : statistics){
+        std::cout << status.name << " (" << status.message << "):";
+        for (const auto &value : status.values){
+            std::cout << " " << value.first << "=" << value.second;
+        }
+        std::cout << std::endl;
+    }
+#else
+    std::cout << "Per-stage latencies need a build with -DTUNNEL_SLAM_PROFILING=ON" << std::endl;
+#endif
+
+    std::vector<std::pair<double, gtsam::Pose3> > keyPoses;
+    graph.getKeyPoses(keyPoses);
+    std::ofstream trajectory(trajectoryFile);
+    trajectory.precision(9);
+    for (const auto &keyPose : keyPoses){
+        const gtsam::Pose3 &pose = keyPose.second;
+        gtsam::Quaternion q = pose.rotation().toQuaternion();
+        trajectory << keyPose.first << " " << pose.x() << " " << pose.y() << " " << pose.z() << " "
+                   << q.x() << " " << q.y() << " " << q.z() << " " << q.w() << "\n";
+    }
+    gtsam::Pose3 finalPose = graph.getCurrentPose();
+    std::cout << "Final pose: " << finalPose.x() << " " << finalPose.y() << " " << finalPose.z()
+              << ", " << keyPoses.size() << " keyframes written to " << trajectoryFile << std::endl;
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Writes a synthetic tunnel run to a bag with the topics of mat2bag.py, so it can be played to the
+// nodes or through tunnel_slam_replay.
+//
+//     tunnel_slam_simulate <bag> [key=value ...]
+//
+// Keys are the TunnelSimulatorParameters in snake case, e.g. shape=curved length=2000 speed=3.
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include <ros/time.h>
+#include <rosbag/bag.h>
+#include <sensor_msgs/Imu.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include "tunnel_simulator.hpp"
+
+int main(int argc, char** argv)
+{
+    TunnelSimulatorParameters parameters;
+    bool valid = argc >= 2;
+    for (int i = 2; i < argc && valid; i++){
+        if (!setSimulatorParameter(parameters, argv[i])){
+            std::cerr << "Unknown or invalid parameter " << argv[i] << std::endl;
+            valid = false;
+        }
+    }
+    if (valid && (parameters.length <= 0 || parameters.speed <= 0 || parameters.scanFrequency <= 0 || parameters.imuFrequency <= 0 || parameters.gnssPeriod <= 0)){
+        std::cerr << "length, speed and the sensor rates must be positive" << std::endl;
+        valid = false;
+    }
+    if (!valid){
+        std::cerr << "usage: " << argv[0] << " <bag> [shape=straight|curved|loop] [length=1000] [speed=1.5] [seed=1] ..." << std::endl;
+        return 1;
+    }
+
+    ros::Time::init();
+    TunnelSimulator simulator(parameters);
+    rosbag::Bag bag;
+    try {
+        bag.open(argv[1], rosbag::bagmode::Write);
+    }
+    catch (const rosbag::BagException &e){
+        std::cerr << "Failed to open " << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Bags do not take a zero stamp, the run starts one second in
+    const double timeOffset = 1;
+    const double duration = simulator.duration();
+    std::cout << "Simulating " << parameters.shape << " tunnel of " << parameters.length << " m, " << duration << " s" << std::endl;
+
+    // Sensors in time order, scans are the slowest to generate so progress is reported on them
+    const double scanPeriod = 1.0 / parameters.scanFrequency, imuPeriod = 1.0 / parameters.imuFrequency;
+    uint64_t nScans = 0, nImu = 0, nGnss = 0;
+    double nextScan = 0, nextImu = 0, nextGnss = 0;
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    while (nextScan <= duration || nextImu <= duration){
+        double t = std::min(nextScan, std::min(nextImu, nextGnss));
+        ros::Time stamp(timeOffset + t);
+        if (t == nextImu){
+            Eigen::Vector3d acceleration, angularVelocity;
+            simulator.imu(t, acceleration, angularVelocity);
+            sensor_msgs::Imu imuMsg;
+            imuMsg.header.stamp = stamp;
+            imuMsg.header.frame_id = "body";
+            imuMsg.linear_acceleration.x = acceleration.x();
+            imuMsg.linear_acceleration.y = acceleration.y();
+            imuMsg.linear_acceleration.z = acceleration.z();
+            imuMsg.angular_velocity.x = angularVelocity.x();
+            imuMsg.angular_velocity.y = angularVelocity.y();
+            imuMsg.angular_velocity.z = angularVelocity.z();
+            bag.write("/imu", stamp, imuMsg);
+
+            // Ground truth at the IMU rate
+            Eigen::Isometry3d pose = simulator.pose(t);
+            Eigen::Quaterniond orientation(pose.linear());
+            geometry_msgs::PoseStamped poseMsg;
+            poseMsg.header.stamp = stamp;
+            poseMsg.header.frame_id = "map";
+            poseMsg.pose.position.x = pose.translation().x();
+            poseMsg.pose.position.y = pose.translation().y();
+            poseMsg.pose.position.z = pose.translation().z();
+            poseMsg.pose.orientation.x = orientation.x();
+            poseMsg.pose.orientation.y = orientation.y();
+            poseMsg.pose.orientation.z = orientation.z();
+            poseMsg.pose.orientation.w = orientation.w();
+            bag.write("/ground_truth", stamp, poseMsg);
+            nImu++;
+            nextImu = nImu*imuPeriod;
+        }
+        else if (t == nextGnss){
+            Eigen::Vector3d position;
+            if (simulator.gnss(t, position)){
+                geometry_msgs::PoseStamped gnssMsg;
+                gnssMsg.header.stamp = stamp;
+                gnssMsg.header.frame_id = "world";
+                gnssMsg.pose.position.x = position.x();
+                gnssMsg.pose.position.y = position.y();
+                gnssMsg.pose.position.z = position.z();
+                gnssMsg.pose.orientation.w = 1;
+                bag.write("/gnss", stamp, gnssMsg);
+                nGnss++;
+            }
+            nextGnss += parameters.gnssPeriod;
+            if (nextGnss > duration)
+                nextGnss = std::numeric_limits<double>::infinity();
+        }
+        else {
+            simulator.scan(t, cloud);
+            sensor_msgs::PointCloud2 scanMsg;
+            pcl::toROSMsg(cloud, scanMsg);
+            scanMsg.header.stamp = stamp;
+            scanMsg.header.frame_id = "lidar";
+            bag.write("/points2", stamp, scanMsg);
+            nScans++;
+            nextScan = nScans*scanPeriod;
+            if (nScans % 100 == 0)
+                std::cout << "  " << t << " / " << duration << " s" << std::endl;
+        }
+    }
+    bag.close();
+    std::cout << "Wrote " << nScans << " scans, " << nImu << " IMU and " << nGnss << " GNSS messages to " << argv[1] << std::endl;
+    return 0;
+}
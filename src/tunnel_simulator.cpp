@@ -0,0 +1,375 @@
+#include "tunnel_simulator.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+//constructor method
+TunnelSimulator::TunnelSimulator(const TunnelSimulatorParameters &parameters) : p(parameters), rng(parameters.seed)
+{
+    halfWidth = 0.5*p.width;
+    wallHeight = std::max(0.0, p.height - halfWidth);
+    tunnelLength = p.length;
+    loop = p.shape == "loop";
+
+    // Centre line, starting at the origin heading along x
+    nTunnelSegments = 0;
+    Segment segment;
+    segment.s0 = 0;
+    segment.start = Eigen::Vector2d::Zero();
+    segment.heading = 0;
+    if (loop){
+        segment.length = tunnelLength;
+        segment.curvature = 2*M_PI / tunnelLength;
+        segments.push_back(segment);
+    }
+    else if (p.shape == "curved"){
+        double sign = 1;
+        while (segment.s0 < tunnelLength){
+            segment.length = std::min(p.curveLength, tunnelLength - segment.s0);
+            segment.curvature = sign / p.curveRadius;
+            segments.push_back(segment);
+            nTunnelSegments = segments.size();
+            _centreLine(segment.s0 + segment.length, segment.start, segment.heading, segment.curvature);
+            segment.s0 += segment.length;
+            sign = -sign;
+        }
+    }
+    else {
+        segment.length = tunnelLength;
+        segment.curvature = 0;
+        segments.push_back(segment);
+    }
+    nTunnelSegments = segments.size();
+
+    // Open road before and after the tunnel, long enough to cover what the sensor sees from the path
+    if (!loop){
+        double extension = p.approach + p.maxRange + p.height;
+        Segment before;
+        before.s0 = -extension;
+        before.length = extension;
+        before.curvature = 0;
+        before.heading = segments.front().heading;
+        before.start = segments.front().start - extension*Eigen::Vector2d(std::cos(before.heading), std::sin(before.heading));
+        Segment after;
+        after.s0 = tunnelLength;
+        after.length = extension;
+        after.curvature = 0;
+        double curvature;
+        _centreLine(tunnelLength, after.start, after.heading, curvature);
+        segments.push_back(before);
+        segments.push_back(after);
+    }
+
+    // Ribs at jittered spacing, so the walls do not repeat exactly
+    std::uniform_real_distribution<double> jitter(-0.25*p.ribSpacing, 0.25*p.ribSpacing);
+    if (p.ribSpacing > 0){
+        for (double s = 0.5*p.ribSpacing; s < tunnelLength; s += p.ribSpacing){
+            ribs.push_back(std::max(0.0, std::min(tunnelLength, s + jitter(rng))));
+        }
+        std::sort(ribs.begin(), ribs.end());
+    }
+
+    // Accelerates from standstill, then holds the speed
+    pathStart = loop ? 0 : -p.approach;
+    pathEnd = loop ? tunnelLength + p.loopRevisit : tunnelLength + p.approach;
+    rampTime = p.acceleration > 0 ? p.speed / p.acceleration : 0;
+    rampLength = 0.5*p.acceleration*rampTime*rampTime;
+    double distance = pathEnd - pathStart;
+    if (distance <= rampLength)
+        tEnd = std::sqrt(2*distance / p.acceleration);
+    else
+        tEnd = rampTime + (distance - rampLength) / p.speed;
+
+    worldFromCentreLine = _poseInCentreLine(pathStart).inverse();
+}
+
+double TunnelSimulator::_arcLength(double t) const
+{
+    t = std::max(0.0, std::min(t, tEnd));
+    if (t < rampTime)
+        return pathStart + 0.5*p.acceleration*t*t;
+    return pathStart + rampLength + p.speed*(t - rampTime);
+}
+
+double TunnelSimulator::_speed(double t) const
+{
+    if (t < 0 || t > tEnd)
+        return 0;
+    return t < rampTime ? p.acceleration*t : p.speed;
+}
+
+void TunnelSimulator::_centreLine(double s, Eigen::Vector2d &point, double &heading, double &curvature) const
+{
+    if (loop)
+        s -= tunnelLength*std::floor(s / tunnelLength);
+    // Past the ends the line continues straight
+    const Segment *segment = &segments.front();
+    for (int i = 0; i < (int) segments.size() && i < nTunnelSegments; i++){
+        if (s >= segments[i].s0)
+            segment = &segments[i];
+    }
+    double ds = s - segment->s0;
+    if (s < 0 || s > segment->s0 + segment->length){
+        double end = s < 0 ? 0 : segment->length;
+        double endHeading = segment->heading + segment->curvature*end;
+        Eigen::Vector2d endPoint;
+        if (segment->curvature == 0)
+            endPoint = segment->start + end*Eigen::Vector2d(std::cos(segment->heading), std::sin(segment->heading));
+        else
+            endPoint = segment->start + Eigen::Vector2d(std::sin(endHeading) - std::sin(segment->heading), std::cos(segment->heading) - std::cos(endHeading)) / segment->curvature;
+        point = endPoint + (ds - end)*Eigen::Vector2d(std::cos(endHeading), std::sin(endHeading));
+        heading = endHeading;
+        curvature = 0;
+        return;
+    }
+    heading = segment->heading + segment->curvature*ds;
+    curvature = segment->curvature;
+    if (curvature == 0)
+        point = segment->start + ds*Eigen::Vector2d(std::cos(heading), std::sin(heading));
+    else
+        point = segment->start + Eigen::Vector2d(std::sin(heading) - std::sin(segment->heading), std::cos(segment->heading) - std::cos(heading)) / curvature;
+}
+
+Eigen::Isometry3d TunnelSimulator::_poseInCentreLine(double s) const
+{
+    Eigen::Vector2d point;
+    double heading, curvature;
+    _centreLine(s, point, heading, curvature);
+    Eigen::Vector2d left(-std::sin(heading), std::cos(heading));
+    Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+    pose.linear() = Eigen::AngleAxisd(heading, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+    pose.translation() << point + p.laneOffset*left, p.sensorHeight;
+    return pose;
+}
+
+Eigen::Isometry3d TunnelSimulator::pose(double t) const
+{
+    return worldFromCentreLine*_poseInCentreLine(_arcLength(t));
+}
+
+Eigen::Vector3d TunnelSimulator::velocity(double t) const
+{
+    // The lane is offset from the centre line, so it is longer on the outside of a bend
+    Eigen::Vector2d point;
+    double heading, curvature;
+    _centreLine(_arcLength(t), point, heading, curvature);
+    Eigen::Vector3d tangent(std::cos(heading), std::sin(heading), 0);
+    return worldFromCentreLine.linear()*tangent*(_speed(t)*(1 - curvature*p.laneOffset));
+}
+
+bool TunnelSimulator::_project(const Segment &segment, const Eigen::Vector2d &point, Projection &projection) const
+{
+    projection.curvature = segment.curvature;
+    if (segment.curvature == 0){
+        Eigen::Vector2d direction(std::cos(segment.heading), std::sin(segment.heading));
+        Eigen::Vector2d offset = point - segment.start;
+        double along = offset.dot(direction);
+        if (along < 0 || along > segment.length)
+            return false;
+        projection.s = segment.s0 + along;
+        projection.lateral = direction.x()*offset.y() - direction.y()*offset.x();
+        return true;
+    }
+    // Arc around its centre, the angle is counted in the direction of travel
+    double radius = 1.0 / std::fabs(segment.curvature);
+    double sign = segment.curvature > 0 ? 1 : -1;
+    Eigen::Vector2d centre = segment.start + sign*radius*Eigen::Vector2d(-std::sin(segment.heading), std::cos(segment.heading));
+    Eigen::Vector2d fromCentre = point - centre, startFromCentre = segment.start - centre;
+    double angle = sign*(std::atan2(fromCentre.y(), fromCentre.x()) - std::atan2(startFromCentre.y(), startFromCentre.x()));
+    angle -= 2*M_PI*std::floor(angle / (2*M_PI));
+    if (angle*radius > segment.length)
+        return false;
+    projection.s = segment.s0 + angle*radius;
+    projection.lateral = sign*(radius - fromCentre.norm());
+    return true;
+}
+
+double TunnelSimulator::_profileDistance(double lateral, double up, double a) const
+{
+    // Union of the walls up to wallHeight and the half-circle roof, the larger inside distance is a lower bound
+    double walls = std::min(std::min(a - std::fabs(lateral), up), wallHeight - up);
+    double roof = std::min(a - std::sqrt(lateral*lateral + (up - wallHeight)*(up - wallHeight)), up);
+    return std::max(walls, roof);
+}
+
+double TunnelSimulator::_ribDistance(double s) const
+{
+    if (ribs.empty())
+        return std::numeric_limits<double>::infinity();
+    double distance = std::numeric_limits<double>::infinity();
+    // Wraps around for the loop
+    for (int wrap = loop ? -1 : 0; wrap <= (loop ? 1 : 0); wrap++){
+        double query = s + wrap*tunnelLength;
+        auto it = std::lower_bound(ribs.begin(), ribs.end(), query);
+        if (it != ribs.end())
+            distance = std::min(distance, std::max(0.0, *it - query - 0.5*p.ribWidth));
+        if (it != ribs.begin())
+            distance = std::min(distance, std::max(0.0, query - *(it - 1) - 0.5*p.ribWidth));
+    }
+    return distance;
+}
+
+double TunnelSimulator::_insideDistance(const Eigen::Vector3d &point) const
+{
+    // Free space is the tunnel bore, and outside the portals the air above the ground. The bore is
+    // carried one metre out of the portals so the two overlap there.
+    const double portalMargin = 1.0;
+    const Eigen::Vector2d point2 = point.head<2>();
+    double bound = -std::numeric_limits<double>::infinity();
+    for (int i : nearbySegments){
+        Projection projection;
+        if (!_project(segments[i], point2, projection))
+            continue;
+        if (!loop && (projection.s < -portalMargin || projection.s > tunnelLength + portalMargin))
+            continue;
+        // Distances along the centre line shrink by up to this factor at the walls on the inside of a bend
+        double scale = std::max(0.0, 1 - std::fabs(projection.curvature)*halfWidth);
+        double full = _profileDistance(projection.lateral, point.z(), halfWidth);
+        double narrow = _profileDistance(projection.lateral, point.z(), halfWidth - p.ribDepth);
+        double wall = std::max(narrow, std::min(full, scale*_ribDistance(projection.s)));
+        if (!loop)
+            wall = std::min(wall, scale*std::min(projection.s + portalMargin, tunnelLength + portalMargin - projection.s));
+        bound = std::max(bound, wall);
+    }
+    if (!loop){
+        const Segment &before = segments[nTunnelSegments], &after = segments[nTunnelSegments + 1];
+        double beforePortal = -(point2 - segments.front().start).dot(Eigen::Vector2d(std::cos(before.heading), std::sin(before.heading)));
+        double afterPortal = (point2 - after.start).dot(Eigen::Vector2d(std::cos(after.heading), std::sin(after.heading)));
+        if (beforePortal > 0)
+            bound = std::max(bound, std::min(point.z(), beforePortal));
+        if (afterPortal > 0)
+            bound = std::max(bound, std::min(point.z(), afterPortal));
+    }
+    return bound;
+}
+
+double TunnelSimulator::_castRay(const Eigen::Vector3d &origin, const Eigen::Vector3d &direction) const
+{
+    // Sphere tracing, every step is the distance the walls are known to be away at least
+    const double epsilon = 1e-3;
+    double range = 0;
+    for (int step = 0; step < 256 && range < p.maxRange; step++){
+        double distance = _insideDistance(origin + range*direction);
+        if (distance < epsilon)
+            return range;
+        range += distance;
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+void TunnelSimulator::scan(double t, pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const double deg2rad = M_PI / 180;
+    const Eigen::Isometry3d sensor = _poseInCentreLine(_arcLength(t));
+    const int rows = std::max(1, (int) std::lround(p.verticalFov / p.verticalResolution));
+    const int cols = std::max(1, (int) std::lround(p.horizontalFov / p.horizontalResolution));
+
+    // Only segments that can be within range are looked at by the ray caster
+    nearbySegments.clear();
+    double reach = p.maxRange + p.height + p.width;
+    for (int i = 0; i < (int) segments.size(); i++){
+        Eigen::Vector2d middle;
+        double heading, curvature;
+        const Segment &segment = segments[i];
+        if (i < nTunnelSegments)
+            _centreLine(segment.s0 + 0.5*segment.length, middle, heading, curvature);
+        else
+            middle = segment.start + 0.5*segment.length*Eigen::Vector2d(std::cos(segment.heading), std::sin(segment.heading));
+        if ((middle - sensor.translation().head<2>()).norm() <= reach + 0.5*segment.length)
+            nearbySegments.push_back(i);
+    }
+
+    std::normal_distribution<double> noise(0, p.rangeNoise);
+    cloud.resize(rows*cols);
+    cloud.width = cols;
+    cloud.height = rows;
+    cloud.is_dense = false;
+    for (int row = 0; row < rows; row++){
+        // Top beam first
+        double elevation = (0.5*p.verticalFov - (row + 0.5)*p.verticalResolution)*deg2rad;
+        for (int col = 0; col < cols; col++){
+            double azimuth = (0.5*p.horizontalFov - (col + 0.5)*p.horizontalResolution)*deg2rad;
+            Eigen::Vector3d direction(std::cos(elevation)*std::cos(azimuth), std::cos(elevation)*std::sin(azimuth), std::sin(elevation));
+            double range = _castRay(sensor.translation(), sensor.linear()*direction);
+            pcl::PointXYZ &point = cloud.at(col, row);
+            if (std::isfinite(range)){
+                range += p.rangeNoise > 0 ? noise(rng) : 0;
+                point.getVector3fMap() = (range*direction).cast<float>();
+            }
+            else {
+                point.x = point.y = point.z = std::numeric_limits<float>::quiet_NaN();
+            }
+        }
+    }
+}
+
+void TunnelSimulator::imu(double t, Eigen::Vector3d &acceleration, Eigen::Vector3d &angularVelocity)
+{
+    double dt = lastImuTime >= 0 && t > lastImuTime ? t - lastImuTime : 1.0 / p.imuFrequency;
+    lastImuTime = t;
+
+    // Exact motion along the lane: tangential acceleration while ramping up, centripetal in the bends
+    Eigen::Vector2d point;
+    double heading, curvature;
+    _centreLine(_arcLength(t), point, heading, curvature);
+    double speed = _speed(t);
+    double tangential = t < rampTime ? p.acceleration : 0;
+    double laneScale = 1 - curvature*p.laneOffset;
+    acceleration = Eigen::Vector3d(laneScale*tangential, laneScale*speed*speed*curvature, p.gravity); // Specific force, gravity points down
+    angularVelocity = Eigen::Vector3d(0, 0, curvature*speed);
+
+    // White noise from the densities, biases as random walks
+    std::normal_distribution<double> normal(0, 1);
+    for (int i = 0; i < 3; i++){
+        accelerometerBias[i] += p.accelerometerBiasWalk*std::sqrt(dt)*normal(rng);
+        gyroscopeBias[i] += p.gyroscopeBiasWalk*std::sqrt(dt)*normal(rng);
+        acceleration[i] += accelerometerBias[i] + p.accelerometerNoise / std::sqrt(dt)*normal(rng);
+        angularVelocity[i] += gyroscopeBias[i] + p.gyroscopeNoise / std::sqrt(dt)*normal(rng);
+    }
+}
+
+bool TunnelSimulator::gnss(double t, Eigen::Vector3d &position)
+{
+    double s = _arcLength(t);
+    if (loop || (s >= 0 && s <= tunnelLength))
+        return false;
+    std::normal_distribution<double> normal(0, 1);
+    position = pose(t).translation();
+    position += Eigen::Vector3d(p.gnssNoiseHorizontal*normal(rng), p.gnssNoiseHorizontal*normal(rng), p.gnssNoiseVertical*normal(rng));
+    return true;
+}
+
+bool setSimulatorParameter(TunnelSimulatorParameters &parameters, const std::string &argument)
+{
+    std::size_t split = argument.find('=');
+    if (split == std::string::npos)
+        return false;
+    const std::string key = argument.substr(0, split), value = argument.substr(split + 1);
+    if (key == "shape"){
+        if (value != "straight" && value != "curved" && value != "loop")
+            return false;
+        parameters.shape = value;
+        return true;
+    }
+    if (key == "seed"){
+        std::istringstream stream(value);
+        return (bool) (stream >> parameters.seed);
+    }
+    std::map<std::string, double*> numbers = {
+        {"length", &parameters.length}, {"width", &parameters.width}, {"height", &parameters.height},
+        {"curve_radius", &parameters.curveRadius}, {"curve_length", &parameters.curveLength},
+        {"rib_spacing", &parameters.ribSpacing}, {"rib_depth", &parameters.ribDepth}, {"rib_width", &parameters.ribWidth},
+        {"loop_revisit", &parameters.loopRevisit}, {"approach", &parameters.approach},
+        {"speed", &parameters.speed}, {"acceleration", &parameters.acceleration},
+        {"sensor_height", &parameters.sensorHeight}, {"lane_offset", &parameters.laneOffset},
+        {"max_range", &parameters.maxRange}, {"range_noise", &parameters.rangeNoise}, {"scan_frequency", &parameters.scanFrequency},
+        {"imu_frequency", &parameters.imuFrequency}, {"gnss_period", &parameters.gnssPeriod}};
+    auto number = numbers.find(key);
+    if (number == numbers.end())
+        return false;
+    std::istringstream stream(value);
+    return (bool) (stream >> *number->second);
+}